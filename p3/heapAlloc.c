@@ -10,21 +10,39 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "heapAlloc.h"
+
+/* HEAP_COMPACT selects 4-byte headers in 64-bit builds, 32-bit builds
+ * already have them.
+ */
+#if defined(HEAP_COMPACT) && UINTPTR_MAX == 0xffffffff
+#undef HEAP_COMPACT
+#endif
  
 /*
  * This structure serves as the header for each allocated and free block.
  * It also serves as the footer for each free block but only containing size.
  */
 typedef struct blockHeader {           
-    int size_status;
+#ifdef HEAP_COMPACT
+    uint32_t size_status;
+#else
+    size_t size_status;
+#endif
     /*
-    * Size of the block is always a multiple of 8.
+    * Size of the block is always a multiple of 8, and of 16 in 64-bit builds.
     * Size is stored in all block headers and free block footers.
+    * With HEAP_COMPACT the 4-byte header stores size / 2, which keeps the
+    * status bits free and allows blocks of up to 8 GB.
     *
-    * Status is stored only in headers using the two least significant bits.
+    * Status is stored only in headers using the three least significant bits.
     *   Bit0 => least significant bit, last bit
     *   Bit0 == 0 => free block
     *   Bit0 == 1 => allocated block
@@ -32,6 +50,9 @@ typedef struct blockHeader {
     *   Bit1 => second last bit 
     *   Bit1 == 0 => previous block is free
     *   Bit1 == 1 => previous block is allocated
+    *
+    *   Bit2 => third last bit, only set in allocated blocks
+    *   Bit2 == 1 => block was freed and waits in the deferred free queue
     * 
     * End Mark: 
     *  The end of the available memory is indicated using a size_status of 1.
@@ -52,270 +73,1652 @@ typedef struct blockHeader {
     */
 } blockHeader;         
 
+/*
+ * Each arena is one anonymous mapping holding blocks and an end mark.
+ * The first arena keeps its descriptor outside the mapping, so its layout
+ * is the original single region. Later arenas start with their descriptor.
+ * Blocks never span arenas, so coalescing stops at an end mark.
+ */
+typedef struct heapArena {
+    struct heapArena *next;  // next arena in address-independent list order
+    struct heapArena *prev;  // previous arena in list order
+    char *base;              // start of the mapping
+    size_t mapsize;          // bytes mapped for this arena
+    blockHeader *first;      // first block in this arena
+    blockHeader *endMark;    // end mark of this arena
+    int pages;               // HEAP_PAGES_* backing the mapping
+    int node;                // NUMA node the mapping is bound to
+} heapArena;
+
+/* Payloads and block sizes are multiples of ALIGNMENT, two pointers:
+ * 8 bytes in 32-bit builds and 16 bytes in 64-bit builds.
+ */
+#define ALIGN_LOG2  (sizeof(size_t) == 8 ? 4 : 3)
+#define ALIGNMENT   ((size_t)1 << ALIGN_LOG2)
+#define ALIGN_UP(n) (((n) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+/* Block size is stored in the upper bits, status in Bit0, Bit1 and Bit2.
+ * PACK converts a size to its stored form, BLOCK_SIZE reads a header
+ * and FOOTER_SIZE reads a footer.
+ */
+#define A_BIT       1
+#define P_BIT       2
+#define D_BIT       4
+#ifdef HEAP_COMPACT
+#define SIZE_SHIFT  1
+#define MAX_BLOCK   (((size_t)UINT32_MAX << SIZE_SHIFT) & ~(ALIGNMENT - 1))
+#else
+#define SIZE_SHIFT  0
+#define MAX_BLOCK   (SIZE_MAX / 2)
+#endif
+#define PACK(size)      ((size) >> SIZE_SHIFT)
+#define BLOCK_SIZE(b)   (((size_t)(b)->size_status & ~(size_t)7) << SIZE_SHIFT)
+#define FOOTER_SIZE(f)  ((size_t)(f)->size_status << SIZE_SHIFT)
+
+/* Offset from the start of an arena mapping to its first block header,
+ * chosen so that every payload is aligned. The first arena only skips
+ * enough bytes for alignment.
+ */
+#define ARENA_HDR   (ALIGN_UP(sizeof(heapArena) + sizeof(blockHeader)) - sizeof(blockHeader))
+#define FIRST_HDR   (ALIGNMENT - sizeof(blockHeader))
+
+/* Free blocks keep their free list links right after the header.
+ * With HEAP_COMPACT a link is a 32-bit index of the block within one
+ * reserved HEAP_RESERVE range, 0 meaning NULL.
+ */
+#ifdef HEAP_COMPACT
+#define HEAP_RESERVE    ((size_t)UINT32_MAX * ALIGNMENT)
+typedef uint32_t blockLink;
+#define TO_LINK(b)      ((b) == NULL ? 0 : \
+                         (blockLink)(((char*)(b) - heapBase) / ALIGNMENT + 1))
+#define FROM_LINK(l)    ((l) == 0 ? NULL : \
+                         (blockHeader*)(heapBase + ((size_t)(l) - 1) * ALIGNMENT + FIRST_HDR))
+#else
+typedef blockHeader *blockLink;
+#define TO_LINK(b)      (b)
+#define FROM_LINK(l)    (l)
+#endif
+
+typedef struct freeLinks {
+    blockLink next;
+    blockLink prev;
+} freeLinks;
+
+#define LINKS(b)    ((freeLinks*)((char*)(b) + sizeof(blockHeader)))
+
+/* Smallest free block, a header, the free list links and a footer.
+ */
+#define MIN_FREE_SIZE ALIGN_UP(2 * sizeof(blockHeader) + sizeof(freeLinks))
+
+/* Two-level segregated fit (TLSF) size classes.
+ * The first level splits block sizes by power of two, the second level
+ * splits each power of two range into SL_COUNT equal classes.
+ * Sizes below SMALL_SIZE share first level 0, one class per ALIGNMENT bytes.
+ */
+#define SL_LOG2     4
+#define SL_COUNT    (1 << SL_LOG2)
+#define FL_SHIFT    (SL_LOG2 + ALIGN_LOG2)
+#define SMALL_SIZE  ((size_t)1 << FL_SHIFT)
+#define FL_COUNT    (8 * sizeof(size_t) - SL_LOG2 - 3 + 1)
+
+/* Deferred frees are coalesced once this many are queued.
+ */
+#define DEFER_BATCH 64
+
+/* Huge page size, 2 MB on x86. With huge pages on, arenas are whole
+ * huge pages starting at a multiple of HUGE_SIZE.
+ */
+#define HUGE_SIZE   ((size_t)2 * 1024 * 1024)
+#define HUGE_UP(n)  (((n) + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1))
+#ifdef MAP_HUGE_SHIFT
+#define MAP_HUGE    (MAP_HUGETLB | (21 << MAP_HUGE_SHIFT))
+#else
+#define MAP_HUGE    MAP_HUGETLB
+#endif
+
+/* HEAP_HARDEN ends every allocated block with a canary word holding the
+ * requested size, scrambled with the block's address, size and a secret
+ * key. The bytes between the payload and the canary are a red zone. The
+ * canary also guards the header of the next block against overflows.
+ * Freed blocks are poisoned and kept in a FIFO quarantine before reuse.
+ */
+#ifdef HEAP_HARDEN
+#define CANARY_SIZE sizeof(size_t)
+#else
+#define CANARY_SIZE 0
+#endif
+#define REDZONE_BYTE        0xFB
+#define POISON_BYTE         0xFD
+#define POISON_LIMIT        1024    // bytes poisoned at the start of a freed payload
+#define QUARANTINE_BLOCKS   256     // freed blocks held before reuse
+#define QUARANTINE_BYTES    (1024 * 1024)
+
+/* Each NUMA node has its own arenas and free lists, up to HEAP_MAX_NODES.
+ * A thread looks up its node again every NODE_REFRESH allocations.
+ */
+#define HEAP_MAX_NODES  8
+#define NODE_REFRESH    64
+#define MPOL_PREFERRED  1
+
+/* Fully free arenas at least this large give their pages back to the OS,
+ * at most once every HEAP_TRIM_INTERVAL frees so that freeing and
+ * allocating in turn does not pay for a syscall and new page faults.
+ */
+#define HEAP_TRIM_THRESHOLD (128 * 1024)
+#define HEAP_TRIM_INTERVAL  32
+
 /* Global variable - DO NOT CHANGE. It should always point to the first block,
  * i.e., the block at the lowest address.
  */
-blockHeader *heapStart = NULL;     
+blockHeader *heapStart = NULL;
 
 /* Size of heap allocation padded to round to nearest page size.
  */
-int allocsize;
+size_t allocsize;
 
 /*
  * Additional global variables may be added as needed below
  */
-blockHeader *prev_alloc = NULL; // stores previously allocated block
-blockHeader *end = NULL; // end of heap
- 
-/* 
+static heapArena firstArena;                        // descriptor of the first arena
+static heapArena *arenaList = NULL;                 // first arena, owns heapStart
+static heapArena *arenaTail = NULL;                 // most recently mapped arena
+static heapArena **arenaIndex = NULL;               // arenas sorted by address
+static size_t arenaCount = 0;                       // arenas in arenaIndex
+static size_t arenaSlots = 0;                       // room in arenaIndex
+static size_t growSize = 0;                         // size of additional arenas, 0 if heap is fixed
+static int hugePages = HEAP_PAGES_NORMAL;           // pages wanted for new arenas
+static unsigned long trimFrees = 0;                 // free count at the last trim
+
+/*
+ * Free blocks of the arenas on one NUMA node.
+ */
+typedef struct heapNode {
+    size_t fl_bitmap;                               // first levels with a free block
+    unsigned int sl_bitmap[FL_COUNT];               // second levels with a free block
+    blockHeader *free_lists[FL_COUNT][SL_COUNT];    // heads of the free lists
+    blockLink quick_lists[SL_COUNT];                // queued blocks below SMALL_SIZE by size
+    blockLink pending_list;                         // queued blocks of other sizes
+} heapNode;
+
+static heapNode nodes[HEAP_MAX_NODES];
+static heapNode *cur = &nodes[0];                   // node the free list functions work on
+static int nodeCount = 1;                           // nodes in use, 1 without NUMA
+static int numaAware = 1;                           // nonzero to look for NUMA nodes
+
+static heapInfo stats;                              // counters kept up to date by every call
+
+static int deferFree = 0;                           // nonzero to queue frees
+
+static void flushDeferred();
+
+#ifdef HEAP_HARDEN
+static void drainQuarantine();
+static size_t heapKey;                              // secret mixed into canaries
+static blockHeader *quarantine[QUARANTINE_BLOCKS];  // freed blocks, oldest at quarantineHead
+static int quarantineHead = 0;
+static int quarantineCount = 0;
+static size_t quarantineBytes = 0;
+#endif
+
+#ifdef HEAP_COMPACT
+static char *heapBase = NULL;                       // start of the reserved range
+static size_t heapUsed = 0;                         // bytes of it mapped by arenas
+#endif
+
+/*
+ * Returns the index of the most significant bit set in size.
+ */
+static int log2Size(size_t size) {
+    return 8 * sizeof(long) - 1 - __builtin_clzl(size);
+}
+
+/*
+ * Maps a block size to its first level fl and second level sl class.
+ */
+static void mapping(size_t size, int *fl, int *sl) {
+    if (size < SMALL_SIZE) {
+        *fl = 0;
+        *sl = size >> ALIGN_LOG2;
+    } else {
+        int msb = log2Size(size);
+        *fl = msb - FL_SHIFT + 1;
+        *sl = (size >> (msb - SL_LOG2)) ^ SL_COUNT;
+    }
+}
+
+/*
+ * Pushes free block onto the free list of its size class.
+ */
+static void insertFree(blockHeader *block) {
+    int fl, sl;
+    mapping(BLOCK_SIZE(block), &fl, &sl);
+
+    blockHeader *head = cur->free_lists[fl][sl];
+    LINKS(block)->next = TO_LINK(head);
+    LINKS(block)->prev = TO_LINK(NULL);
+    if (head != NULL) {
+        LINKS(head)->prev = TO_LINK(block);
+    }
+    cur->free_lists[fl][sl] = block;
+    cur->fl_bitmap |= (size_t)1 << fl;
+    cur->sl_bitmap[fl] |= 1u << sl;
+
+    stats.bytes_free += BLOCK_SIZE(block);
+    stats.free_blocks++;
+    stats.free_by_class[log2Size(BLOCK_SIZE(block))]++;
+}
+
+/*
+ * Unlinks free block from the free list of its size class.
+ */
+static void removeFree(blockHeader *block) {
+    int fl, sl;
+    mapping(BLOCK_SIZE(block), &fl, &sl);
+
+    stats.bytes_free -= BLOCK_SIZE(block);
+    stats.free_blocks--;
+    stats.free_by_class[log2Size(BLOCK_SIZE(block))]--;
+
+    blockHeader *next = FROM_LINK(LINKS(block)->next);
+    blockHeader *prev = FROM_LINK(LINKS(block)->prev);
+    if (next != NULL) {
+        LINKS(next)->prev = TO_LINK(prev);
+    }
+    if (prev != NULL) {
+        LINKS(prev)->next = TO_LINK(next);
+        return;
+    }
+    cur->free_lists[fl][sl] = next;
+    if (next == NULL) {
+        cur->sl_bitmap[fl] &= ~(1u << sl);
+        if (cur->sl_bitmap[fl] == 0) {
+            cur->fl_bitmap &= ~((size_t)1 << fl);
+        }
+    }
+}
+
+/*
+ * Returns a free block of at least size bytes in constant time, taken
+ * from the smallest non-empty class whose blocks are all large enough.
+ * Returns NULL if there is no such class.
+ */
+static blockHeader* searchFree(size_t size) {
+    int fl, sl;
+
+    // round up to the next class so that any block in it fits
+    if (size >= SMALL_SIZE) {
+        size_t round = ((size_t)1 << (log2Size(size) - SL_LOG2)) - 1;
+        if (size > SIZE_MAX - round) {
+            return NULL;
+        }
+        size += round;
+    }
+    mapping(size, &fl, &sl);
+    if (fl >= (int)FL_COUNT) {
+        return NULL;
+    }
+
+    unsigned int sl_map = cur->sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0) {
+        size_t fl_map = fl + 1 < (int)FL_COUNT ? cur->fl_bitmap & (~(size_t)0 << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
+        }
+        fl = __builtin_ffsl(fl_map) - 1;
+        sl_map = cur->sl_bitmap[fl];
+    }
+    sl = __builtin_ffs(sl_map) - 1;
+    return cur->free_lists[fl][sl];
+}
+
+/*
+ * Maps mapsize bytes of zeroed memory at hint, or anywhere if hint is NULL.
+ * Argument flags: extra mmap flags.
+ * Returns the start of the mapping on success.
+ * Returns NULL on failure.
+ */
+static char* mapPages(char *hint, size_t mapsize, int flags) {
+    char *base = mmap(hint, mapsize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return MAP_FAILED == base ? NULL : base;
+}
+
+/*
+ * Maps mapsize bytes of zeroed memory for an arena.
+ * Argument pages: set to the HEAP_PAGES_* actually backing the mapping.
+ * With HEAP_COMPACT arenas are carved in order from one reserved range,
+ * so that every block can be reached through a 32-bit link.
+ * With huge pages on, explicit huge pages fall back to transparent ones
+ * and those to normal pages, so a mapping only fails for lack of memory.
+ * Returns the start of the mapping on success.
+ * Returns NULL on failure.
+ */
+static char* mapRegion(size_t mapsize, int *pages) {
+    char *base = NULL;
+
+    *pages = HEAP_PAGES_NORMAL;
+
+#ifdef HEAP_COMPACT
+    if (heapBase == NULL) {
+        // one huge page extra, so the range can start on a huge page
+        char *range = mmap(NULL, HEAP_RESERVE + HUGE_SIZE, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == range) {
+            return NULL;
+        }
+        heapBase = (char*)HUGE_UP((uintptr_t)range);
+    }
+    size_t start = hugePages != HEAP_PAGES_NORMAL ? HUGE_UP(heapUsed) : heapUsed;
+    if (start > HEAP_RESERVE || mapsize > HEAP_RESERVE - start) {
+        return NULL;
+    }
+    if (hugePages == HEAP_PAGES_HUGETLB) {
+        base = mapPages(heapBase + start, mapsize, MAP_FIXED | MAP_HUGE);
+        if (base != NULL) {
+            *pages = HEAP_PAGES_HUGETLB;
+        }
+    }
+    if (base == NULL) {
+        base = mapPages(heapBase + start, mapsize, MAP_FIXED);
+        if (base == NULL) {
+            return NULL;
+        }
+    }
+    heapUsed = start + mapsize;
+#else
+    if (hugePages == HEAP_PAGES_HUGETLB) {
+        base = mapPages(NULL, mapsize, MAP_HUGE);
+        if (base != NULL) {
+            *pages = HEAP_PAGES_HUGETLB;
+            return base;
+        }
+    }
+    if (hugePages != HEAP_PAGES_NORMAL) {
+        // map a huge page extra and cut the mapping down to a huge page boundary
+        char *raw = mapPages(NULL, mapsize + HUGE_SIZE, 0);
+        if (raw == NULL) {
+            return NULL;
+        }
+        base = (char*)HUGE_UP((uintptr_t)raw);
+        if (base != raw) {
+            munmap(raw, base - raw);
+        }
+        munmap(base + mapsize, raw + HUGE_SIZE - base);
+    } else {
+        base = mapPages(NULL, mapsize, 0);
+        if (base == NULL) {
+            return NULL;
+        }
+    }
+#endif
+
+    if (*pages == HEAP_PAGES_NORMAL && hugePages != HEAP_PAGES_NORMAL &&
+        madvise(base, mapsize, MADV_HUGEPAGE) == 0) {
+        *pages = HEAP_PAGES_THP;
+    }
+    return base;
+}
+
+/*
+ * Unmaps the most recently mapped arena's memory.
+ */
+static void unmapRegion(char *base, size_t mapsize) {
+#ifdef HEAP_COMPACT
+    // hand the range back to the reservation
+    mmap(base, mapsize, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    heapUsed = base - heapBase;
+#else
+    munmap(base, mapsize);
+#endif
+}
+
+/*
+ * Returns the NUMA node of the CPU the calling thread runs on.
+ * The thread's node is kept in initial-exec TLS, which never allocates,
+ * so this works inside a malloc built on the heap.
+ */
+static int localNode() {
+    static __thread int node __attribute__((tls_model("initial-exec"))) = 0;
+    static __thread unsigned int calls __attribute__((tls_model("initial-exec"))) = 0;
+    unsigned int cpu, found;
+
+    if (nodeCount == 1) {
+        return 0;
+    }
+    if (calls++ % NODE_REFRESH == 0 &&
+        syscall(SYS_getcpu, &cpu, &found, NULL) == 0 && found < (unsigned int)nodeCount) {
+        node = found;
+    }
+    return node;
+}
+
+/*
+ * Sets nodeCount from the NUMA nodes online, 1 if there is only one or
+ * the system does not say.
+ * Uses read rather than stdio, which may allocate.
+ */
+static void findNodes() {
+    char online[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    ssize_t len = fd < 0 ? -1 : read(fd, online, sizeof(online) - 1);
+    int node = 0;
+    int i;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    nodeCount = 1;
+    if (len <= 0) {
+        return;
+    }
+    // a list of ranges such as 0-1 or 0,2-3, so the last number is the highest node
+    for (i = 0; i < len; i++) {
+        if (online[i] >= '0' && online[i] <= '9') {
+            node = node * 10 + online[i] - '0';
+        } else if (online[i] == '-' || online[i] == ',') {
+            node = 0;
+        }
+    }
+    nodeCount = node + 1 < HEAP_MAX_NODES ? node + 1 : HEAP_MAX_NODES;
+}
+
+/*
+ * Asks for the pages of a new arena to come from node.
+ * A failure leaves them placed by first touch, which is still local to
+ * the thread that maps the arena.
+ */
+static void bindNode(char *base, size_t mapsize, int node) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, base, mapsize, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, 0);
+}
+
+/*
+ * Returns the number of arenas in arenaIndex whose first block is below ptr.
+ */
+static size_t arenasBelow(void *ptr) {
+    size_t lo = 0;
+    size_t hi = arenaCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((char*)arenaIndex[mid]->first < (char*)ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Adds arena to arenaIndex, mapping a larger index when it is full.
+ * The index has its own mapping, since the heap may be serving malloc.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int indexArena(heapArena *arena) {
+    if (arenaCount == arenaSlots) {
+        size_t slots = arenaSlots == 0 ? getpagesize() / sizeof(heapArena*) : 2 * arenaSlots;
+        heapArena **index = (heapArena**)mapPages(NULL, slots * sizeof(heapArena*), 0);
+        if (index == NULL) {
+            return -1;
+        }
+        if (arenaIndex != NULL) {
+            memcpy(index, arenaIndex, arenaCount * sizeof(heapArena*));
+            munmap(arenaIndex, arenaSlots * sizeof(heapArena*));
+        }
+        arenaIndex = index;
+        arenaSlots = slots;
+    }
+    size_t pos = arenasBelow(arena->first);
+    memmove(&arenaIndex[pos + 1], &arenaIndex[pos], (arenaCount - pos) * sizeof(heapArena*));
+    arenaIndex[pos] = arena;
+    arenaCount++;
+    return 0;
+}
+
+/*
+ * Removes arena from arenaIndex.
+ */
+static void unindexArena(heapArena *arena) {
+    size_t pos = arenasBelow(arena->first);
+    arenaCount--;
+    memmove(&arenaIndex[pos], &arenaIndex[pos + 1], (arenaCount - pos) * sizeof(heapArena*));
+}
+
+/*
+ * Maps a new arena able to hold a free block of at least minBlock bytes
+ * on the current node and links it at the tail of the arena list.
+ * Returns the new arena on success.
+ * Returns NULL on failure.
+ */
+static heapArena* mapArena(size_t sizeOfRegion, size_t minBlock) {
+
+    size_t pagesize = getpagesize();
+    size_t mapsize = sizeOfRegion;
+    size_t hdrsize = arenaList == NULL ? FIRST_HDR : ARENA_HDR;
+    heapArena *arena;
+    char *base;
+
+    if (minBlock > SIZE_MAX - hdrsize - sizeof(blockHeader) - pagesize) {
+        return NULL;
+    }
+    if (mapsize < minBlock + hdrsize + sizeof(blockHeader)) {
+        mapsize = minBlock + hdrsize + sizeof(blockHeader);
+    }
+    // round up to a multiple of pagesize
+    if (hugePages != HEAP_PAGES_NORMAL) {
+        pagesize = HUGE_SIZE;
+    }
+    mapsize += (pagesize - mapsize % pagesize) % pagesize;
+
+    // the arena's single free block must fit in a header
+    if (mapsize - hdrsize - sizeof(blockHeader) > MAX_BLOCK) {
+        mapsize = (MAX_BLOCK + hdrsize + sizeof(blockHeader)) & ~(pagesize - 1);
+        if (mapsize < minBlock + hdrsize + sizeof(blockHeader)) {
+            return NULL;
+        }
+    }
+
+    int pages;
+    base = mapRegion(mapsize, &pages);
+    if (base == NULL) {
+        return NULL;
+    }
+
+    arena = arenaList == NULL ? &firstArena : (heapArena*)base;
+    arena->next = NULL;
+    arena->prev = arenaTail;
+    arena->base = base;
+    arena->mapsize = mapsize;
+    arena->pages = pages;
+    arena->first = (blockHeader*)(base + hdrsize);
+    arena->endMark = (blockHeader*)(base + mapsize - sizeof(blockHeader));
+    if (indexArena(arena) != 0) {
+        unmapRegion(base, mapsize);
+        return NULL;
+    }
+    arena->node = cur - nodes;
+    if (nodeCount > 1) {
+        bindNode(base, mapsize, arena->node);
+    }
+    if (pages != HEAP_PAGES_NORMAL) {
+        stats.huge_bytes += mapsize;
+    }
+
+    // one big free block whose previous block counts as allocated
+    size_t size = (char*)arena->endMark - (char*)arena->first;
+    arena->first->size_status = PACK(size) + P_BIT;
+    ((blockHeader*)((char*)arena->endMark - sizeof(blockHeader)))->size_status = PACK(size);
+    arena->endMark->size_status = 1;
+    insertFree(arena->first);
+
+    if (arenaTail == NULL) {
+        arenaList = arena;
+    } else {
+        arenaTail->next = arena;
+    }
+    arenaTail = arena;
+    allocsize += size;
+
+    return arena;
+}
+
+/*
+ * Returns the arena whose blocks contain address ptr or NULL if none does.
+ * Binary searches arenaIndex, so the cost grows with the log of the arenas.
+ */
+static heapArena* findArena(void *ptr) {
+    size_t below = arenasBelow(ptr);
+    if (below == 0) {
+        return NULL;
+    }
+    heapArena *arena = arenaIndex[below - 1];
+    return (char*)ptr < (char*)arena->endMark ? arena : NULL;
+}
+
+/*
+ * Writes the header and footer of a free block of size bytes.
+ * Argument pbit: the P_BIT status of the block before it.
+ */
+static void setFree(blockHeader *block, size_t size, int pbit) {
+    block->size_status = PACK(size) | pbit;
+    ((blockHeader*)((char*)block + size - sizeof(blockHeader)))->size_status = PACK(size);
+}
+
+/*
+ * Returns the block size needed for a payload of size bytes, rounded up
+ * to a multiple of ALIGNMENT and large enough to hold a free block once freed.
+ * Returns 0 if size is too large for any block.
+ */
+static size_t blockSize(size_t size) {
+    if (size > MAX_BLOCK - ALIGNMENT - sizeof(blockHeader) - CANARY_SIZE) {
+        return 0;
+    }
+    size_t start_size = ALIGN_UP(size + sizeof(blockHeader) + CANARY_SIZE);
+    return start_size < MIN_FREE_SIZE ? MIN_FREE_SIZE : start_size;
+}
+
+#ifdef HEAP_HARDEN
+/*
+ * Reports heap corruption found at block and aborts.
+ */
+static void heapCorrupt(blockHeader *block, const char *what) {
+    fprintf(stderr, "heapAlloc: %s at %p\n", what, (void*)block);
+    abort();
+}
+
+/*
+ * Returns the canary of allocated block before the requested size is mixed in.
+ */
+static size_t blockCanary(blockHeader *block) {
+    return heapKey ^ ((uintptr_t)block * (size_t)0x9E3779B97F4A7C15ull) ^ BLOCK_SIZE(block);
+}
+
+/*
+ * Returns the requested size stored in allocated block's canary, or
+ * (size_t)-1 if the canary or the red zone before it was overwritten.
+ */
+static size_t canarySize(blockHeader *block) {
+    size_t size = BLOCK_SIZE(block);
+    char *payload = (char*)block + sizeof(blockHeader);
+    char *tail = (char*)block + size - CANARY_SIZE;
+    size_t request;
+
+    memcpy(&request, tail, CANARY_SIZE);
+    request ^= blockCanary(block);
+    if (size < sizeof(blockHeader) + CANARY_SIZE ||
+        request > size - sizeof(blockHeader) - CANARY_SIZE) {
+        return (size_t)-1;
+    }
+    for (payload += request; payload < tail; payload++) {
+        if (*(unsigned char*)payload != REDZONE_BYTE) {
+            return (size_t)-1;
+        }
+    }
+    return request;
+}
+#endif
+
+/*
+ * Records the requested size of allocated block in HEAP_HARDEN builds,
+ * writing its red zone and canary.
+ */
+static void armBlock(blockHeader *block, size_t request) {
+#ifdef HEAP_HARDEN
+    char *tail = (char*)block + BLOCK_SIZE(block) - CANARY_SIZE;
+    char *payload = (char*)block + sizeof(blockHeader);
+    memset(payload + request, REDZONE_BYTE, tail - payload - request);
+    request ^= blockCanary(block);
+    memcpy(tail, &request, CANARY_SIZE);
+#else
+    (void)block;
+    (void)request;
+#endif
+}
+
+/*
+ * Returns the number of payload bytes allocated block can hold, which in
+ * HEAP_HARDEN builds is the requested size once its canary is checked.
+ */
+static size_t payloadSize(blockHeader *block) {
+#ifdef HEAP_HARDEN
+    size_t request = canarySize(block);
+    if (request == (size_t)-1) {
+        heapCorrupt(block, "overwritten canary");
+    }
+    return request;
+#else
+    return BLOCK_SIZE(block) - sizeof(blockHeader);
+#endif
+}
+
+/*
+ * Shrinks allocated block to size bytes. The remainder becomes a free
+ * block, merged with the next block if that one is free too. A remainder
+ * too small to be a free block on its own stays part of the block.
+ */
+static void shrinkBlock(blockHeader *block, size_t size) {
+
+    size_t rest_size = BLOCK_SIZE(block) - size;
+    if (rest_size == 0) {
+        return;
+    }
+
+    blockHeader *rest = (blockHeader*)((char*)block + size);
+    blockHeader *next = (blockHeader*)((char*)rest + rest_size);
+    if (!(next->size_status & A_BIT)) {
+        removeFree(next);
+        rest_size += BLOCK_SIZE(next);
+    } else if (rest_size < MIN_FREE_SIZE) {
+        return;
+    } else if (next->size_status != 1) {
+        next->size_status &= ~P_BIT;
+    }
+
+    block->size_status = PACK(size) | (block->size_status & P_BIT) | A_BIT;
+    setFree(rest, rest_size, P_BIT);
+    insertFree(rest);
+}
+
+/*
+ * Returns a fully free arena's memory to the OS, unless the last trim
+ * was less than HEAP_TRIM_INTERVAL frees ago.
+ * Trailing arenas are unmapped. The first arena is kept mapped since it
+ * owns heapStart, but its pages are released if it is large enough.
+ */
+static void trimArenas() {
+
+    heapNode *saved = cur;
+
+    if (stats.free_count - trimFrees < HEAP_TRIM_INTERVAL) {
+        return;
+    }
+
+    while (arenaTail != arenaList) {
+        heapArena *last = arenaTail;
+        size_t size = (char*)last->endMark - (char*)last->first;
+        if ((last->first->size_status & A_BIT) || BLOCK_SIZE(last->first) != size) {
+            return;
+        }
+        trimFrees = stats.free_count;
+
+        arenaTail = last->prev;
+        arenaTail->next = NULL;
+        unindexArena(last);
+        allocsize -= size;
+
+        cur = &nodes[last->node];
+        removeFree(last->first);
+        if (last->pages != HEAP_PAGES_NORMAL) {
+            stats.huge_bytes -= last->mapsize;
+        }
+        unmapRegion(last->base, last->mapsize);
+    }
+    cur = saved;
+
+    size_t size = (char*)arenaList->endMark - (char*)arenaList->first;
+    if (arenaList->mapsize >= HEAP_TRIM_THRESHOLD &&
+        !(heapStart->size_status & A_BIT) && BLOCK_SIZE(heapStart) == size) {
+        // keep the pages holding the header and footer of the free block,
+        // releasing only whole huge pages so the rest stays on huge pages
+        size_t pagesize = arenaList->pages != HEAP_PAGES_NORMAL ? HUGE_SIZE : getpagesize();
+        char *lo = arenaList->base + pagesize;
+        char *hi = arenaList->base + arenaList->mapsize - pagesize;
+        if (hi > lo) {
+            madvise(lo, hi - lo, MADV_DONTNEED);
+            trimFrees = stats.free_count;
+        }
+    }
+}
+
+/*
+ * Returns the number of bytes to skip at the start of free block so that
+ * the payload after them is a multiple of align. Skipped bytes are always
+ * enough to form a free block of their own.
+ */
+static size_t alignSlack(blockHeader *block, size_t align) {
+    uintptr_t payload = (uintptr_t)block + sizeof(blockHeader);
+    size_t slack = (align - payload % align) % align;
+    if (slack != 0 && slack < MIN_FREE_SIZE) {
+        slack += align;
+    }
+    return slack;
+}
+
+/*
+ * Returns a free block of the current node that fits size bytes with a
+ * payload aligned to align, or NULL if there is none.
+ * Argument need: block size that fits whatever the alignment.
+ * Looks in the smallest size class that is sure to fit, then first-fit
+ * in the request's own class, which may also fit.
+ */
+static blockHeader* searchNode(size_t size, size_t align, size_t need) {
+
+    blockHeader *block = searchFree(need);
+    if (block != NULL) {
+        return block;
+    }
+
+    int fl, sl;
+    mapping(size, &fl, &sl);
+    for (block = cur->free_lists[fl][sl]; block != NULL; block = FROM_LINK(LINKS(block)->next)) {
+        if (BLOCK_SIZE(block) >= size + alignSlack(block, align)) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Finds a free block holding size bytes with a payload aligned to align.
+ * Uses TLSF GOOD-FIT placement on the current node, which allocations set
+ * to the caller's.
+ * Coalesces deferred frees and retries if no block fits.
+ * Maps an additional arena if still no block fits and the heap is growable.
+ * Otherwise takes a block from another node, leaving cur on that node.
+ * Returns the free block on success, still on its free list and with
+ * its leading slack not yet split off.
+ * Returns NULL on failure.
+ */
+static blockHeader* findFit(size_t size, size_t align) {
+
+    // worst case slack is less than align plus a minimal free block
+    size_t need = align > ALIGNMENT ? size + align + MIN_FREE_SIZE : size;
+
+    blockHeader *block = searchNode(size, align, need);
+    if (block != NULL) {
+        return block;
+    }
+
+    // queued frees may coalesce into a fit
+#ifdef HEAP_HARDEN
+    if (quarantineCount != 0) {
+        drainQuarantine();
+        return findFit(size, align);
+    }
+#endif
+    if (stats.deferred_blocks != 0) {
+        flushDeferred();
+        return findFit(size, align);
+    }
+
+    if (growSize != 0) {
+        heapArena *arena = mapArena(growSize, need);
+        if (arena != NULL) {
+            return arena->first;
+        }
+    }
+
+    // last resort, a free block on another node
+    heapNode *local = cur;
+    int n;
+    for (n = 0; n < nodeCount; n++) {
+        if (&nodes[n] == local) {
+            continue;
+        }
+        cur = &nodes[n];
+        block = searchNode(size, align, need);
+        if (block != NULL) {
+            stats.remote_allocs++;
+            return block;
+        }
+    }
+    cur = local;
+    return NULL;
+}
+
+/*
+ * Allocates size bytes at the start of free block, SPLITTING off the
+ * remainder as a free block when it is large enough to be one.
+ * The block must already be off its free list.
+ */
+static void placeBlock(blockHeader *block, size_t size) {
+
+    size_t curr_block_size = BLOCK_SIZE(block);
+    int p_bit = block->size_status & P_BIT;
+
+    if (curr_block_size - size >= MIN_FREE_SIZE) {
+        // split, the remainder is a free block after an allocated one
+        blockHeader *rest = (blockHeader*)((char*)block + size);
+        setFree(rest, curr_block_size - size, P_BIT);
+        insertFree(rest);
+    } else {
+        // use the whole block, tell the next block its predecessor is now allocated
+        size = curr_block_size;
+        blockHeader *next = (blockHeader*)((char*)block + curr_block_size);
+        if (next->size_status != 1) {
+            next->size_status |= P_BIT;
+        }
+    }
+
+    block->size_status = PACK(size) | p_bit | A_BIT;
+}
+
+/*
  * Function for allocating 'size' bytes of heap memory.
  * Argument size: requested size for the payload
  * Returns address of allocated block on success.
  * Returns NULL on failure.
  * This function should:
  * - Check size - Return NULL if not positive or if larger than heap space.
- * - Determine block size rounding up to a multiple of 8 and possibly adding padding as a result.
- * - Use NEXT-FIT PLACEMENT POLICY to chose a free block
+ * - Determine block size rounding up to a multiple of ALIGNMENT and possibly adding padding as a result.
+ * - Reuse a queued free of exactly that size when DEFERRED COALESCING is on.
+ * - Use TLSF GOOD-FIT PLACEMENT POLICY to chose a free block in constant time,
+ *   from the arenas on the calling thread's NUMA node.
  * - Use SPLITTING to divide the chosen free block into two if it is too large.
  * - Update header(s) and footer as needed.
+ * - Map an additional arena if no block fits and the heap is growable.
  * Tips: Be careful with pointer arithmetic and scale factors.
  */
-void* allocHeap(int size) {     
-    //TODO: Your code goes in here.
-   // if size is less than 1, return NULL
-   if (size < 1){
-   	return NULL;
-   }
-   // add padding for block header
-   int start_size = size + sizeof(blockHeader);
-   
-   // if block size is not a multiple of 8, then add padding
-   // to ensure double word addressibility
-   if(start_size % 8 != 0){
-   	start_size = start_size + (8 - (start_size % 8)); 
-   }
-
-   // if heap is not initialized return NULL
-   if (heapStart == NULL){
-   	return NULL;
-   }
-   blockHeader *newBlock = NULL;
-
-   // check if first allocation
-   if (prev_alloc == NULL){
-   	prev_alloc = heapStart;
-	end = (blockHeader*)((void*)heapStart + heapStart->size_status - heapStart->size_status % 8);
-   }
-   blockHeader *current_block = prev_alloc;
-   
-   // find where to allocate next block based on next_fit placement policy
-   while((current_block->size_status - (current_block->size_status % 8)) < start_size || (current_block->size_status % 2) != 0){
-   	
-	current_block = (blockHeader*)((void*)current_block + current_block->size_status - current_block->size_status % 8);
-	
-	// check if loop has made it through every block in heap
-	if(current_block == prev_alloc){
-		return NULL;
-	}
-	
-	// check to see if loop has made it to end of heap, if so, start from beginning
-	if(current_block->size_status == 1){
-		
-		current_block = heapStart;
-		
-		if(current_block == prev_alloc){
-			return NULL;
-		}
-	}
-   
-   }
-	
-   int curr_block_size = current_block->size_status - current_block->size_status%8;
-   int p_bit = current_block->size_status%8;
-   
-   // if current block size is odd then return null as it was allocated incorrectly
-   if(curr_block_size < start_size || current_block->size_status%2 == 1){
-   	return NULL;
-   }
-   // for splitting
-   if(start_size < curr_block_size){
-   	newBlock = (blockHeader*)((void*)current_block + start_size);
-	newBlock ->size_status = curr_block_size + 2 - start_size;
-   }
-   // updates footer
-   blockHeader *footer = (blockHeader*)((char*)current_block + curr_block_size - sizeof(blockHeader));
-   if(start_size == curr_block_size){
-   	footer = NULL;
-   }
-   else {
-   	footer->size_status = curr_block_size - start_size;
-	}
-	
-   // update current block
-   current_block->size_status = start_size + p_bit + 1;
-   // update previously allocated block with current block
-   prev_alloc = current_block;
-
-   
-
-   // return pointer to payload
-   return ((void*)current_block + sizeof(blockHeader));
-} 
- 
-/* 
+void* allocHeap(size_t size) {
+
+    // if size is less than 1 or heap is not initialized, return NULL
+    if (size < 1 || heapStart == NULL) {
+        return NULL;
+    }
+
+    // add padding for block header and round up to a multiple of ALIGNMENT
+    // to ensure double word addressibility
+    size_t start_size = blockSize(size);
+    if (start_size == 0) {
+        return NULL;
+    }
+    cur = &nodes[localNode()];
+
+    // reuse a queued free of the same size as it is
+    if (start_size < SMALL_SIZE && cur->quick_lists[start_size >> ALIGN_LOG2]) {
+        blockHeader *block = FROM_LINK(cur->quick_lists[start_size >> ALIGN_LOG2]);
+        cur->quick_lists[start_size >> ALIGN_LOG2] = LINKS(block)->next;
+        block->size_status &= ~D_BIT;
+        stats.deferred_blocks--;
+        stats.alloc_count++;
+        armBlock(block, size);
+        return (char*)block + sizeof(blockHeader);
+    }
+
+    blockHeader *current_block = findFit(start_size, ALIGNMENT);
+    if (current_block == NULL) {
+        return NULL;
+    }
+    removeFree(current_block);
+    placeBlock(current_block, start_size);
+    armBlock(current_block, size);
+    stats.alloc_count++;
+
+    // return pointer to payload
+    return (char*)current_block + sizeof(blockHeader);
+}
+
+/*
+ * Function for allocating 'size' bytes of heap memory at an address that
+ * is a multiple of 'align', e.g. for SIMD or cache line aligned buffers.
+ * Argument size: requested size for the payload
+ * Argument align: required payload alignment, a power of two
+ * Returns address of allocated block on success.
+ * Returns NULL on failure.
+ * This function should:
+ * - Return NULL if align is not a power of two.
+ * - Use TLSF GOOD-FIT PLACEMENT POLICY to chose a free block with room for
+ *   the aligned payload.
+ * - Return the bytes in front of the aligned block to the heap as a free block.
+ * - Use SPLITTING to free the bytes after it.
+ */
+void* allocHeapAligned(size_t size, size_t align) {
+
+    if (align < 1 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= ALIGNMENT) {
+        return allocHeap(size);
+    }
+    if (size < 1 || heapStart == NULL || align > SIZE_MAX / 4) {
+        return NULL;
+    }
+
+    size_t start_size = blockSize(size);
+    if (start_size == 0) {
+        return NULL;
+    }
+    cur = &nodes[localNode()];
+
+    blockHeader *current_block = findFit(start_size, align);
+    if (current_block == NULL) {
+        return NULL;
+    }
+    removeFree(current_block);
+
+    size_t slack = alignSlack(current_block, align);
+    if (slack != 0) {
+        // the leading slack stays free, its predecessor is unchanged
+        size_t curr_block_size = BLOCK_SIZE(current_block);
+        setFree(current_block, slack, current_block->size_status & P_BIT);
+        insertFree(current_block);
+        current_block = (blockHeader*)((char*)current_block + slack);
+        setFree(current_block, curr_block_size - slack, 0);
+    }
+    placeBlock(current_block, start_size);
+    armBlock(current_block, size);
+    stats.alloc_count++;
+
+    return (char*)current_block + sizeof(blockHeader);
+}
+
+/*
+ * Frees allocated block, coalescing it with free neighbors right away.
+ * Does not release arenas.
+ */
+static void coalesceBlock(blockHeader *current_block) {
+
+    size_t curr_block_size = BLOCK_SIZE(current_block);
+    int p_bit = current_block->size_status & P_BIT;
+
+    // check front, the end mark counts as allocated
+    blockHeader *next_block = (blockHeader*)((char*)current_block + curr_block_size);
+    if (!(next_block->size_status & A_BIT)) {
+        removeFree(next_block);
+        curr_block_size += BLOCK_SIZE(next_block);
+    }
+
+    // check backside using the p-bit, the previous free block has a footer
+    if (!p_bit) {
+        blockHeader *prev_foot = (blockHeader*)((char*)current_block - sizeof(blockHeader));
+        current_block = (blockHeader*)((char*)current_block - FOOTER_SIZE(prev_foot));
+        removeFree(current_block);
+        curr_block_size += FOOTER_SIZE(prev_foot);
+        p_bit = current_block->size_status & P_BIT;
+    }
+
+    setFree(current_block, curr_block_size, p_bit);
+    insertFree(current_block);
+
+    // change p bit of next block
+    next_block = (blockHeader*)((char*)current_block + curr_block_size);
+    if (next_block->size_status != 1) {
+        next_block->size_status &= ~P_BIT;
+    }
+}
+
+/*
+ * Coalesces every block in the deferred free queue and releases
+ * arenas left fully free.
+ */
+static void flushDeferred() {
+
+    int i, n;
+    blockHeader *block;
+    heapNode *saved = cur;
+
+    for (n = 0; n < nodeCount; n++) {
+        cur = &nodes[n];
+        for (i = 0; i <= SL_COUNT; i++) {
+            blockLink *list = i < SL_COUNT ? &cur->quick_lists[i] : &cur->pending_list;
+            while ((block = FROM_LINK(*list)) != NULL) {
+                *list = LINKS(block)->next;
+                block->size_status &= ~D_BIT;
+                coalesceBlock(block);
+            }
+        }
+    }
+    stats.deferred_blocks = 0;
+    cur = saved;
+
+    trimArenas();
+}
+
+/*
+ * Queues allocated block for a later coalescing free. It stays marked
+ * allocated, so neighbors being freed leave it alone.
+ */
+static void deferBlock(blockHeader *block) {
+
+    size_t size = BLOCK_SIZE(block);
+    blockLink *list = size < SMALL_SIZE ? &cur->quick_lists[size >> ALIGN_LOG2] : &cur->pending_list;
+
+    block->size_status |= D_BIT;
+    LINKS(block)->next = *list;
+    *list = TO_LINK(block);
+    stats.deferred_blocks++;
+}
+
+/*
+ * Returns the allocated block whose payload is at ptr, making its node
+ * the current one.
+ * Returns NULL if ptr is not the payload of an allocated block.
+ */
+static blockHeader* checkBlock(void *ptr) {
+
+    // if ptr is null return NULL
+    if (ptr == NULL) {
+        return NULL;
+    }
+    // check if ptr is a multiple of ALIGNMENT
+    if ((uintptr_t)ptr % ALIGNMENT != 0) {
+        return NULL;
+    }
+    // check if ptr is outside of heap space
+    heapArena *arena = findArena(ptr);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    blockHeader *block = (blockHeader*)((char*)ptr - sizeof(blockHeader));
+
+    // check if it has already been freed, now or deferred
+    if (!(block->size_status & A_BIT) || (block->size_status & D_BIT)) {
+        return NULL;
+    }
+#ifdef HEAP_HARDEN
+    if (BLOCK_SIZE(block) > (size_t)((char*)arena->endMark - (char*)block)) {
+        heapCorrupt(block, "overwritten header");
+    }
+#endif
+    cur = &nodes[arena->node];
+    return block;
+}
+
+/*
+ * Frees allocated block, queued or right away depending on deferFreeHeap.
+ */
+static void releaseBlock(blockHeader *block) {
+    if (deferFree) {
+        deferBlock(block);
+        if (stats.deferred_blocks >= DEFER_BATCH) {
+            flushDeferred();
+        }
+        return;
+    }
+    coalesceBlock(block);
+    trimArenas();
+}
+
+#ifdef HEAP_HARDEN
+/*
+ * Returns nonzero if a quarantined block's poison was not written to.
+ */
+static int poisonIntact(blockHeader *block) {
+    unsigned char *payload = (unsigned char*)block + sizeof(blockHeader);
+    size_t size = canarySize(block);
+    size_t i;
+
+    if (size == (size_t)-1) {
+        return 0;
+    }
+    for (i = 0; i < size && i < POISON_LIMIT; i++) {
+        if (payload[i] != POISON_BYTE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Removes the oldest block from the quarantine and returns it, making
+ * its node the current one.
+ */
+static blockHeader* unquarantine() {
+    blockHeader *block = quarantine[quarantineHead];
+    quarantineHead = (quarantineHead + 1) % QUARANTINE_BLOCKS;
+    quarantineCount--;
+    quarantineBytes -= BLOCK_SIZE(block);
+
+    if (!poisonIntact(block)) {
+        heapCorrupt(block, "write after free");
+    }
+    block->size_status &= ~D_BIT;
+    cur = &nodes[findArena((char*)block + sizeof(blockHeader))->node];
+    return block;
+}
+
+/*
+ * Checks allocated block's canary, poisons its payload and quarantines it.
+ * The block stays marked allocated with Bit2 set, so freeing it again is
+ * caught and neighbors being freed leave it alone.
+ * Returns the block leaving the quarantine to make room, to be freed.
+ * Returns NULL if none has to leave.
+ */
+static blockHeader* quarantineBlock(blockHeader *block) {
+    size_t size = payloadSize(block);
+
+    memset((char*)block + sizeof(blockHeader), POISON_BYTE,
+           size < POISON_LIMIT ? size : POISON_LIMIT);
+    block->size_status |= D_BIT;
+
+    blockHeader *oldest = NULL;
+    if (quarantineCount == QUARANTINE_BLOCKS || quarantineBytes > QUARANTINE_BYTES) {
+        oldest = unquarantine();
+    }
+    quarantine[(quarantineHead + quarantineCount) % QUARANTINE_BLOCKS] = block;
+    quarantineCount++;
+    quarantineBytes += BLOCK_SIZE(block);
+    return oldest;
+}
+
+/*
+ * Frees every quarantined block.
+ */
+static void drainQuarantine() {
+    heapNode *saved = cur;
+    while (quarantineCount != 0) {
+        releaseBlock(unquarantine());
+    }
+    cur = saved;
+}
+#endif
+
+/*
  * Function for freeing up a previously allocated block.
  * Argument ptr: address of the block to be freed up.
  * Returns 0 on success.
  * Returns -1 on failure.
  * This function should:
  * - Return -1 if ptr is NULL.
- * - Return -1 if ptr is not a multiple of 8.
+ * - Return -1 if ptr is not a multiple of ALIGNMENT.
  * - Return -1 if ptr is outside of the heap space.
  * - Return -1 if ptr block is already freed.
- * - USE IMMEDIATE COALESCING if one or both of the adjacent neighbors are free.
+ * - In HEAP_HARDEN builds, abort if the block's canary was overwritten and
+ *   hold the block in QUARANTINE before freeing it.
+ * - USE IMMEDIATE COALESCING if one or both of the adjacent neighbors are free,
+ *   or queue the block for DEFERRED COALESCING when deferFreeHeap is on.
  * - Update header(s) and footer as needed.
- */                    
-int freeHeap(void *ptr) {    
-    //TODO: Your code goes in here.
-  	
-    // if ptr is null return -1
-    if(ptr == NULL){
-    	return -1;
-    }
-    // check if ptr is a multiple of 8
-    if((int)&ptr % 8 != 0){
-    	return -1;
+ * - Release trailing arenas left fully free.
+ */
+int freeHeap(void *ptr) {
+
+    blockHeader *current_block = checkBlock(ptr);
+    if (current_block == NULL) {
+#ifdef HEAP_HARDEN
+        if (ptr != NULL) {
+            fprintf(stderr, "heapAlloc: free of invalid or freed pointer %p\n", ptr);
+        }
+#endif
+        return -1;
     }
-    // check if ptr is outside of heap space
-    if(ptr < (void*)heapStart || ptr > (void*)end){
-    	return -1;
+    stats.free_count++;
+    if (cur != &nodes[localNode()]) {
+        stats.remote_frees++;
     }
-    // check if it has already been freed
-    if(((blockHeader*)((void*)ptr-sizeof(blockHeader)))->size_status%2 != 1){
-    	 return -1;
+
+#ifdef HEAP_HARDEN
+    current_block = quarantineBlock(current_block);
+    if (current_block == NULL) {
+        return 0;
     }
+#endif
+    releaseBlock(current_block);
+
+    return 0;
+}
+
+/*
+ * Function for freeing up several previously allocated blocks at once.
+ * Argument ptrs: addresses of the blocks to be freed up.
+ * Argument n: number of addresses in ptrs.
+ * Returns 0 on success.
+ * Returns -1 if any address could not be freed, the others still are.
+ * All blocks are coalesced in a single pass at the end.
+ */
+int freeHeapBatch(void **ptrs, int n) {
 
-    blockHeader *current_block = (blockHeader*)(ptr-sizeof(blockHeader));
-    int curr_block_size = current_block->size_status - current_block->size_status % 8;
+    int i;
+    int result = 0;
 
-    // check backside by checking p-bit to see if prev block is alloc'd
-    if (current_block->size_status - (current_block->size_status%2) == 0){
-    	blockHeader *prev_foot = (blockHeader*)((void*)current_block - sizeof(blockHeader));
-	blockHeader *prev_block = (blockHeader*)((void*)current_block - prev_foot->size_status);
-	curr_block_size += prev_foot->size_status;
-	current_block = prev_block;
-	current_block->size_status = curr_block_size + prev_block->size_status % 8;
-	current_block = current_block - current_block->size_status % 2;
+    for (i = 0; i < n; i++) {
+        blockHeader *block = checkBlock(ptrs[i]);
+        if (block == NULL) {
+            result = -1;
+            continue;
+        }
+        stats.free_count++;
+        if (cur != &nodes[localNode()]) {
+            stats.remote_frees++;
+        }
+#ifdef HEAP_HARDEN
+        block = quarantineBlock(block);
+        if (block == NULL) {
+            continue;
+        }
+#endif
+        deferBlock(block);
     }
+    flushDeferred();
 
-    blockHeader *next_block = (blockHeader*)((void*) current_block + curr_block_size);
-    // check front by checking p-bit of next block
-    if(next_block->size_status % 2 == 0){
-    	curr_block_size = curr_block_size + next_block->size_status - next_block->size_status % 8;
-	current_block->size_status = curr_block_size + current_block->size_status % 8;
-	current_block->size_status = current_block->size_status - current_block->size_status % 2;
+    return result;
+}
 
+/*
+ * Function for turning NUMA awareness off, to be called before initHeap.
+ * Argument enable: nonzero, the default, for arenas and free lists per
+ * NUMA node, with each allocation served from the caller's node. Zero
+ * treats the machine as a single node, as does a single node machine.
+ * Returns 0 on success.
+ * Returns -1 if the heap is already initialized.
+ */
+int numaHeap(int enable) {
+    if (heapStart != NULL) {
+        return -1;
     }
+    numaAware = enable;
+    return 0;
+}
 
-    // change header of curr block to represent freedom
-    current_block->size_status = current_block->size_status - 1;
+/*
+ * Function for switching DEFERRED COALESCING on or off.
+ * Argument enable: nonzero to queue freed blocks and coalesce them in
+ * batches, when an allocation finds no fit, or when switched off.
+ * While on, an allocation of a small size first reuses a queued block
+ * of exactly that size without any splitting or coalescing.
+ */
+void deferFreeHeap(int enable) {
+    deferFree = enable;
+    if (!enable) {
+        flushDeferred();
+    }
+}
 
-    //footer
-    blockHeader *footer = (blockHeader*)((char*) current_block + curr_block_size - sizeof(blockHeader));
-    footer -> size_status = curr_block_size;
+/*
+ * Function for choosing the pages backing arenas mapped from now on.
+ * Call it before initHeap to have the first arena on huge pages too.
+ * Argument mode: one of
+ * - HEAP_PAGES_NORMAL for base pages.
+ * - HEAP_PAGES_THP for transparent huge pages through madvise.
+ * - HEAP_PAGES_HUGETLB for explicit huge pages, which need pages reserved
+ *   in /proc/sys/vm/nr_hugepages, else transparent ones.
+ * Arenas are then rounded up to whole HUGE_SIZE pages and aligned to them.
+ * Returns 0 on success.
+ * Returns -1 if mode is not valid.
+ */
+int hugePagesHeap(int mode) {
+    if (mode != HEAP_PAGES_NORMAL && mode != HEAP_PAGES_THP && mode != HEAP_PAGES_HUGETLB) {
+        return -1;
+    }
+    hugePages = mode;
+    return 0;
+}
 
-    // change p bit of next block
-    blockHeader *next = (blockHeader*)((void*)current_block + current_block->size_status - current_block->size_status % 8);
-    if(next->size_status - (next->size_status % 2) != 0){
-    	next->size_status = next->size_status - 2;
+/*
+ * Function for resizing a previously allocated block.
+ * Argument ptr: address of the allocated block, or NULL to allocate.
+ * Argument size: requested size for the payload, less than 1 to free.
+ * Returns address of the resized block on success, ptr's contents are kept.
+ * Returns NULL on failure, in which case ptr is left untouched.
+ * This function should:
+ * - Shrink in place by SPLITTING off the end of the block.
+ * - Grow in place by absorbing the next block if it is free and big enough.
+ * - Otherwise grow by absorbing the previous free block and moving the payload.
+ * - Only allocate, copy and free when neighbors cannot supply enough space.
+ */
+void* reallocHeap(void *ptr, size_t size) {
+
+    if (ptr == NULL) {
+        return allocHeap(size);
+    }
+    if (size < 1) {
+        freeHeap(ptr);
+        return NULL;
     }
-    // change prev allocated if needed	
-    if(current_block == prev_alloc){
-    	prev_alloc = current_block;
+    if (blockSize(size) == 0) {
+        return NULL;
     }
 
-    return 0;
-} 
- 
+    blockHeader *current_block = checkBlock(ptr);
+    if (current_block == NULL) {
+        return NULL;
+    }
+
+    size_t start_size = blockSize(size);
+    size_t curr_block_size = BLOCK_SIZE(current_block);
+
+    // checks the canary in HEAP_HARDEN builds
+    payloadSize(current_block);
+
+    // shrink or keep in place
+    if (start_size <= curr_block_size) {
+        shrinkBlock(current_block, start_size);
+        armBlock(current_block, size);
+        return ptr;
+    }
+
+    // space available from the free neighbors, end marks count as allocated
+    blockHeader *next_block = (blockHeader*)((char*)current_block + curr_block_size);
+    size_t next_size = (next_block->size_status & A_BIT) ? 0 : BLOCK_SIZE(next_block);
+    size_t prev_size = 0;
+    if (!(current_block->size_status & P_BIT)) {
+        prev_size = FOOTER_SIZE((blockHeader*)((char*)current_block - sizeof(blockHeader)));
+    }
+
+    // grow in place into the next block
+    if (curr_block_size + next_size >= start_size) {
+        blockHeader *after = (blockHeader*)((char*)next_block + next_size);
+        if (after->size_status != 1) {
+            after->size_status |= P_BIT;
+        }
+        removeFree(next_block);
+        current_block->size_status += PACK(next_size);
+        shrinkBlock(current_block, start_size);
+        armBlock(current_block, size);
+        return ptr;
+    }
+
+    // grow backwards into the previous block, moving the payload down
+    if (prev_size + curr_block_size + next_size >= start_size) {
+        blockHeader *prev_block = (blockHeader*)((char*)current_block - prev_size);
+        blockHeader *after = (blockHeader*)((char*)next_block + next_size);
+        if (after->size_status != 1) {
+            after->size_status |= P_BIT;
+        }
+        if (next_size != 0) {
+            removeFree(next_block);
+        }
+        removeFree(prev_block);
+        memmove((char*)prev_block + sizeof(blockHeader), ptr, payloadSize(current_block));
+        prev_block->size_status = PACK(prev_size + curr_block_size + next_size)
+                                  | (prev_block->size_status & P_BIT) | A_BIT;
+        shrinkBlock(prev_block, start_size);
+        armBlock(prev_block, size);
+        return (char*)prev_block + sizeof(blockHeader);
+    }
+
+    // no room next to the block, allocate, copy and free
+    void *new_ptr = allocHeap(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, payloadSize(current_block));
+    freeHeap(ptr);
+
+    return new_ptr;
+}
+
 /*
+ * Function for finding the usable size of a previously allocated block.
+ * Argument ptr: address of the allocated block.
+ * Returns the number of payload bytes the block can hold.
+ * Returns 0 if ptr is not an allocated block.
+ */
+size_t sizeHeap(void *ptr) {
 
- * Function used to initialize the memory allocator.
- * Intended to be called ONLY once by a program.
- * Argument sizeOfRegion: the size of the heap space to be allocated.
+    blockHeader *block = checkBlock(ptr);
+    if (block == NULL) {
+        return 0;
+    }
+    return payloadSize(block);
+}
+
+/*
+ * Function for reading allocator statistics without walking the heap.
+ * Argument info: filled in with the current counters.
+ * Only the free list of the largest size class in use on each node is walked, so
+ * this is cheap enough for a periodic sampler unless that list grows long.
+ * A signal handler may call it as long as the signal cannot interrupt the
+ * allocator itself.
+ */
+void heapStats(heapInfo *info) {
+
+    *info = stats;
+    info->bytes_used = allocsize - stats.bytes_free;
+    info->largest_free = 0;
+    info->fragmentation = 0.0;
+
+    info->numa_nodes = nodeCount;
+#ifdef HEAP_HARDEN
+    info->quarantine_bytes = quarantineBytes;
+#endif
+
+    int n;
+    for (n = 0; n < nodeCount; n++) {
+        heapNode *node = &nodes[n];
+        if (node->fl_bitmap == 0) {
+            continue;
+        }
+        int fl = log2Size(node->fl_bitmap);
+        int sl = log2Size(node->sl_bitmap[fl]);
+        blockHeader *block;
+        for (block = node->free_lists[fl][sl]; block != NULL; block = FROM_LINK(LINKS(block)->next)) {
+            if (BLOCK_SIZE(block) > info->largest_free) {
+                info->largest_free = BLOCK_SIZE(block);
+            }
+        }
+    }
+    if (info->bytes_free == 0) {
+        return;
+    }
+    // share of free memory not usable by the largest possible request
+    info->fragmentation = 1.0 - (double)info->largest_free / info->bytes_free;
+}
+
+/*
+ * Maps the first arena and sets heapStart.
+ * Argument growable: nonzero to map more arenas of sizeOfRegion bytes on demand.
  * Returns 0 on success.
  * Returns -1 on failure.
- */                    
-int initHeap(int sizeOfRegion) {    
- 
+ */
+static int startHeap(size_t sizeOfRegion, int growable) {
+
     static int allocated_once = 0; //prevent multiple initHeap calls
- 
-    int pagesize;  // page size
-    int padsize;   // size of padding when heap size not a multiple of page size
-    void* mmap_ptr; // pointer to memory mapped area
-    int fd;
 
-    blockHeader* endMark;
-  
     if (0 != allocated_once) {
-        fprintf(stderr, 
+        fprintf(stderr,
         "Error:mem.c: InitHeap has allocated space during a previous call\n");
         return -1;
     }
-    if (sizeOfRegion <= 0) {
+    if (sizeOfRegion == 0) {
         fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
         return -1;
     }
 
-    // Get the pagesize
-    pagesize = getpagesize();
-
-    // Calculate padsize as the padding required to round up sizeOfRegion 
-    // to a multiple of pagesize
-    padsize = sizeOfRegion % pagesize;
-    padsize = (pagesize - padsize) % pagesize;
-
-    allocsize = sizeOfRegion + padsize;
-
-    // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
-        return -1;
+    if (numaAware) {
+        findNodes();
     }
-    mmap_ptr = mmap(NULL, allocsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (MAP_FAILED == mmap_ptr) {
+    cur = &nodes[localNode()];
+
+    // Using anonymous mmap to allocate memory, rounded up to pagesize
+    if (NULL == mapArena(sizeOfRegion, 0)) {
         fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
-        allocated_once = 0;
         return -1;
     }
-  
+
     allocated_once = 1;
 
-    // for double word alignment and end mark
-    allocsize -= 8;
+#ifdef HEAP_HARDEN
+    if (getrandom(&heapKey, sizeof(heapKey), GRND_NONBLOCK) != sizeof(heapKey)) {
+        heapKey = (size_t)time(NULL) ^ (uintptr_t)&heapKey;
+    }
+#endif
 
     // Initially there is only one big free block in the heap.
-    // Skip first 4 bytes for double word alignment requirement.
-    heapStart = (blockHeader*) mmap_ptr + 1;
+    heapStart = arenaList->first;
+    growSize = growable ? arenaList->mapsize : 0;
+
+    return 0;
+}
+
+/*
+ * Function used to initialize the memory allocator.
+ * Intended to be called ONLY once by a program.
+ * Argument sizeOfRegion: the size of the heap space to be allocated.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int initHeap(size_t sizeOfRegion) {
+    return startHeap(sizeOfRegion, 0);
+}
 
-    // Set the end mark
-    endMark = (blockHeader*)((void*)heapStart + allocsize);
-    endMark->size_status = 1;
+/*
+ * Function used to initialize a heap that grows on demand.
+ * Intended to be called ONLY once by a program, instead of initHeap.
+ * Argument arenaSize: the size of the first arena and of each arena mapped
+ * when no free block fits. Larger requests get an arena of their own.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int initHeapGrowable(size_t arenaSize) {
+    return startHeap(arenaSize, 1);
+}
 
-    // Set size in header
-    heapStart->size_status = allocsize;
+/*
+ * Function for validating the whole heap on demand.
+ * Walks every arena checking that:
+ * - Block sizes are multiples of ALIGNMENT and blocks end at the end mark.
+ * - Each P bit matches the previous block and no two free blocks are adjacent.
+ * - Free block footers match their headers and the free lists hold them all.
+ * - In HEAP_HARDEN builds, canaries, red zones and quarantine poison are intact.
+ *   Blocks queued for deferred coalescing are skipped, their link
+ *   overwrites the start of the payload and may reach the red zone.
+ * Returns 0 if the heap is consistent.
+ * Returns -1 after printing the first problem found to stderr.
+ */
+int checkHeap() {
 
-    // Set p-bit as allocated in header
-    // note a-bit left at 0 for free
-    heapStart->size_status += 2;
+    heapArena *arena;
+    size_t free_blocks = 0;
+    size_t free_bytes = 0;
+
+    for (arena = arenaList; arena != NULL; arena = arena->next) {
+        blockHeader *block = arena->first;
+        int prev_alloc = 1;
+
+        while (block < arena->endMark) {
+            size_t size = BLOCK_SIZE(block);
+            int alloc = block->size_status & A_BIT;
+            const char *problem = NULL;
+
+            if (size == 0 || size % ALIGNMENT != 0 ||
+                size > (size_t)((char*)arena->endMark - (char*)block)) {
+                problem = "bad block size";
+            } else if (!(block->size_status & P_BIT) != !prev_alloc) {
+                problem = "P bit does not match previous block";
+            } else if (!alloc && !prev_alloc) {
+                problem = "adjacent free blocks";
+            } else if (!alloc && FOOTER_SIZE((blockHeader*)((char*)block + size) - 1) != size) {
+                problem = "footer does not match header";
+            } else if (!alloc && (block->size_status & D_BIT)) {
+                problem = "free block marked deferred";
+            }
+#ifdef HEAP_HARDEN
+            else if (alloc && !(block->size_status & D_BIT) && canarySize(block) == (size_t)-1) {
+                problem = "overwritten canary";
+            }
+#endif
+            if (problem != NULL) {
+                fprintf(stderr, "heapAlloc: checkHeap: %s at %p\n", problem, (void*)block);
+                return -1;
+            }
+
+            if (!alloc) {
+                free_blocks++;
+                free_bytes += size;
+            }
+            prev_alloc = alloc;
+            block = (blockHeader*)((char*)block + size);
+        }
+        if (block != arena->endMark || arena->endMark->size_status != 1) {
+            fprintf(stderr, "heapAlloc: checkHeap: bad end mark at %p\n", (void*)arena->endMark);
+            return -1;
+        }
+    }
+
+    if (free_blocks != stats.free_blocks || free_bytes != stats.bytes_free) {
+        fprintf(stderr, "heapAlloc: checkHeap: free lists hold %lu blocks of %lu bytes, heap has %lu of %lu\n",
+                (unsigned long)stats.free_blocks, (unsigned long)stats.bytes_free,
+                (unsigned long)free_blocks, (unsigned long)free_bytes);
+        return -1;
+    }
+
+#ifdef HEAP_HARDEN
+    int i;
+    for (i = 0; i < quarantineCount; i++) {
+        blockHeader *block = quarantine[(quarantineHead + i) % QUARANTINE_BLOCKS];
+        if (!poisonIntact(block)) {
+            fprintf(stderr, "heapAlloc: checkHeap: write after free at %p\n", (void*)block);
+            return -1;
+        }
+    }
+#endif
 
-    // Set the footer
-    blockHeader *footer = (blockHeader*) ((void*)heapStart + allocsize - 4);
-    footer->size_status = allocsize;
-  
     return 0;
-} 
-                  
+}
+
 /* 
  * Function to be used for DEBUGGING to help you visualize your heap structure.
  * Prints out a list of all the blocks including this information:
@@ -333,13 +1736,14 @@ void dumpMem() {
     char p_status[5];
     char *t_begin = NULL;
     char *t_end   = NULL;
-    int t_size;
+    size_t t_size;
 
     blockHeader *current = heapStart;
+    heapArena *arena = arenaList;
     counter = 1;
 
-    int used_size = 0;
-    int free_size = 0;
+    size_t used_size = 0;
+    size_t free_size = 0;
     int is_used   = -1;
 
     fprintf(stdout, "************************************Block list***\
@@ -368,6 +1772,7 @@ void dumpMem() {
         } else {
             strcpy(p_status, "Free");
         }
+        t_size = BLOCK_SIZE(current);
 
         if (is_used) 
             used_size += t_size;
@@ -376,20 +1781,27 @@ void dumpMem() {
 
         t_end = t_begin + t_size - 1;
     
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%d\n", counter, status, 
-        p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%lu\n", counter, status, 
+        p_status, (unsigned long int)t_begin, (unsigned long int)t_end,
+        (unsigned long int)t_size);
     
         current = (blockHeader*)((char*)current + t_size);
         counter = counter + 1;
+
+        // continue with the next arena after an end mark
+        if (current->size_status == 1 && arena->next != NULL) {
+            arena = arena->next;
+            current = arena->first;
+        }
     }
 
     fprintf(stdout, "---------------------------------------------------\
                     ------------------------------\n");
     fprintf(stdout, "***************************************************\
                     ******************************\n");
-    fprintf(stdout, "Total used size = %d\n", used_size);
-    fprintf(stdout, "Total free size = %d\n", free_size);
-    fprintf(stdout, "Total size = %d\n", used_size + free_size);
+    fprintf(stdout, "Total used size = %lu\n", (unsigned long int)used_size);
+    fprintf(stdout, "Total free size = %lu\n", (unsigned long int)free_size);
+    fprintf(stdout, "Total size = %lu\n", (unsigned long int)(used_size + free_size));
     fprintf(stdout, "***************************************************\
                     ******************************\n");
     fflush(stdout);
@@ -8,13 +8,53 @@
 #ifndef __heapAlloc_h
 #define __heapAlloc_h
 
-int   initHeap (int sizeOfRegion);
-void* allocHeap(int size);
+#include <stddef.h>
+
+/*
+ * Allocator statistics returned by heapStats().
+ * Block sizes include headers, so bytes_used + bytes_free is the heap size.
+ * The counters are copied in constant time, but largest_free walks the whole
+ * free list of the top size class on each node, so its cost grows with that
+ * list. heapStats takes no lock and is safe in a signal handler only when
+ * the signal cannot interrupt the allocator itself.
+ */
+typedef struct heapInfo {
+    size_t bytes_used;          // bytes in allocated blocks
+    size_t bytes_free;          // bytes in free blocks
+    size_t largest_free;        // size of the largest free block
+    size_t free_blocks;         // number of free blocks
+    size_t free_by_class[64];   // free blocks with size in [2^i, 2^(i+1))
+    size_t deferred_blocks;     // freed blocks not yet coalesced, counted as used
+    size_t quarantine_bytes;    // freed blocks in the HEAP_HARDEN quarantine, counted as used
+    size_t huge_bytes;          // bytes mapped for arenas on huge pages
+    unsigned long alloc_count;  // successful allocations
+    unsigned long free_count;   // successful frees
+    int numa_nodes;             // NUMA nodes with their own arenas
+    unsigned long remote_allocs; // allocations served from another node
+    unsigned long remote_frees;  // frees by a thread on another node
+    double fragmentation;       // 1 - largest_free / bytes_free, 0 when none free
+} heapInfo;
+
+/*
+ * Pages backing heap arenas, see hugePagesHeap().
+ */
+#define HEAP_PAGES_NORMAL   0   // base pages
+#define HEAP_PAGES_THP      1   // transparent huge pages
+#define HEAP_PAGES_HUGETLB  2   // explicit huge pages
+
+int   initHeap (size_t sizeOfRegion);
+int   initHeapGrowable(size_t arenaSize);
+void* allocHeap(size_t size);
+void* allocHeapAligned(size_t size, size_t align);
 int   freeHeap (void *ptr);
+int   freeHeapBatch(void **ptrs, int n);
+void  deferFreeHeap(int enable);
+int   hugePagesHeap(int mode);
+int   numaHeap(int enable);
+int   checkHeap();
+void* reallocHeap(void *ptr, size_t size);
+size_t sizeHeap(void *ptr);
+void  heapStats(heapInfo *info);
 void  dumpMem  ();
 
-void* malloc(size_t size) {
-    return NULL;
-}
-
 #endif // __heapAlloc_h__
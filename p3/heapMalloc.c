@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Main File:        heapMalloc.c
+// This File:        heapMalloc.c
+// Other Files:      heapAlloc.c heapAlloc.h
+//
+// Drop-in replacement for the C library allocator built on heapAlloc.
+// Build libheapmalloc.so with make BITS=64 for 64-bit programs (plain
+// make builds a 32-bit library) and preload it into any program:
+//     LD_PRELOAD=./libheapmalloc.so ../p2A/n_in_a_row ../p2A/board1.txt
+// Set HEAP_DEFER=1 in the environment to coalesce frees in batches.
+// Set HEAP_HUGE=thp or HEAP_HUGE=hugetlb to map arenas on huge pages.
+// Set HEAP_NUMA=0 to use one set of arenas on NUMA machines.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "heapAlloc.h"
+
+/* Size of each arena mapped by the heap, the first one included.
+ */
+#define ARENA_SIZE (1024 * 1024)
+
+/* heapAlloc is single threaded, every entry point below holds this lock.
+ */
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+static int heapReady = 0;
+static int forkReady = 0;
+
+static void lockHeap()   { pthread_mutex_lock(&heapLock); }
+static void unlockHeap() { pthread_mutex_unlock(&heapLock); }
+
+/* A fork while another thread holds the lock must not leave the
+ * child with a heap it can never lock again.
+ */
+static void childHeap()  { pthread_mutex_init(&heapLock, NULL); }
+
+/*
+ * Initializes the heap on first use.
+ * Must be called with the lock held.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int startHeap() {
+    if (!heapReady) {
+        const char *numa = getenv("HEAP_NUMA");
+        if (numa != NULL && strcmp(numa, "0") == 0) {
+            numaHeap(0);
+        }
+        const char *huge = getenv("HEAP_HUGE");
+        if (huge != NULL && strcmp(huge, "thp") == 0) {
+            hugePagesHeap(HEAP_PAGES_THP);
+        } else if (huge != NULL && strcmp(huge, "hugetlb") == 0) {
+            hugePagesHeap(HEAP_PAGES_HUGETLB);
+        }
+        if (initHeapGrowable(ARENA_SIZE) != 0) {
+            return -1;
+        }
+        const char *defer = getenv("HEAP_DEFER");
+        if (defer != NULL && defer[0] != '\0' && defer[0] != '0') {
+            deferFreeHeap(1);
+        }
+        heapReady = 1;
+    }
+    return 0;
+}
+
+/*
+ * Allocates size bytes with the lock held.
+ * Returns NULL and sets errno on failure.
+ */
+static void* allocLocked(size_t size) {
+
+    void *ptr = NULL;
+
+    // zero byte requests still get a unique block
+    if (size == 0) {
+        size = 1;
+    }
+
+    if (startHeap() == 0) {
+        ptr = allocHeap(size);
+    }
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    lockHeap();
+    void *ptr = allocLocked(size);
+    unlockHeap();
+
+    // registering may itself allocate, so do it outside the lock and once
+    if (!forkReady && heapReady && !__atomic_exchange_n(&forkReady, 1, __ATOMIC_ACQ_REL)) {
+        pthread_atfork(lockHeap, unlockHeap, childHeap);
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    lockHeap();
+    // blocks from before the heap existed (e.g. the dynamic loader's) are ignored
+    freeHeap(ptr);
+    unlockHeap();
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = malloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+void* realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    lockHeap();
+    void *new_ptr = reallocHeap(ptr, size);
+    unlockHeap();
+
+    if (new_ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return new_ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    // alignment must be a power of two multiple of sizeof(void*)
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+
+    void *ptr = NULL;
+    lockHeap();
+    if (startHeap() == 0) {
+        ptr = allocHeapAligned(size, alignment);
+    }
+    unlockHeap();
+
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = NULL;
+    int err;
+
+    if (alignment < sizeof(void*)) {
+        alignment = sizeof(void*);
+    }
+    err = posix_memalign(&ptr, alignment, size);
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    return ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return aligned_alloc(getpagesize(), size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    lockHeap();
+    size_t size = sizeHeap(ptr);
+    unlockHeap();
+    return size;
+}
+
+void malloc_stats() {
+    heapInfo info;
+
+    lockHeap();
+    heapStats(&info);
+    unlockHeap();
+
+    fprintf(stderr, "heap bytes in use   = %lu\n", (unsigned long)info.bytes_used);
+    fprintf(stderr, "heap bytes free     = %lu\n", (unsigned long)info.bytes_free);
+    fprintf(stderr, "largest free block  = %lu\n", (unsigned long)info.largest_free);
+    fprintf(stderr, "free blocks         = %lu\n", (unsigned long)info.free_blocks);
+    fprintf(stderr, "allocations / frees = %lu / %lu\n", info.alloc_count, info.free_count);
+    fprintf(stderr, "fragmentation       = %.3f\n", info.fragmentation);
+}
@@ -0,0 +1,580 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Main File:        heapTrace.c
+// This File:        heapTrace.c
+// Other Files:      heapAlloc.c heapAlloc.h
+//
+// Records allocation traces and replays them as a benchmark.
+//     heapTrace record malloctrace.out run.htr
+//     heapTrace replay run.htr heap
+//     heapTrace replay run.htr glibc
+//
+// record reads the text output of the Pin malloctrace tool, i.e.
+//     malloc(SIZE)              free(ADDR)
+//       returns ADDR            realloc(ADDR, SIZE)
+//                                 returns ADDR
+// with decimal or 0x prefixed hex numbers, and writes a binary trace.
+// Addresses are replaced by object ids, so a replay does not depend on
+// where the traced program's allocator placed its blocks.
+//
+// Trace file format, all integers LEB128 varints:
+//     "HTR1" ops objects   then ops records of   op id [size]
+// op is 0 for malloc (with size), 1 for free, 2 for realloc (with size).
+// ids are reused once freed, so objects is the most ever live at once.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heapAlloc.h"
+
+#define OP_MALLOC   0
+#define OP_FREE     1
+#define OP_REALLOC  2
+#define OP_COUNT    3
+
+/* Arena size for the heapAlloc replay.
+ */
+#define ARENA_SIZE (1024 * 1024)
+
+/* Number of utilization samples printed over the course of a replay.
+ */
+#define SAMPLES 20
+
+static const char *opNames[OP_COUNT] = { "malloc", "free", "realloc" };
+
+/*
+ * One decoded trace record.
+ */
+typedef struct traceOp {
+    unsigned char op;
+    size_t id;
+    size_t size;
+} traceOp;
+
+/*
+ * Allocator under test.
+ */
+typedef struct backend {
+    const char *name;
+    int   (*init)();
+    void* (*alloc)(size_t size);
+    void  (*release)(void *ptr);
+    void* (*resize)(void *ptr, size_t size);
+    size_t (*footprint)();
+} backend;
+
+static int heapInit()                { return initHeapGrowable(ARENA_SIZE); }
+static void heapRelease(void *ptr)   { freeHeap(ptr); }
+static size_t heapFootprint() {
+    heapInfo info;
+    heapStats(&info);
+    return info.bytes_used + info.bytes_free;
+}
+
+/* glibc also holds the harness's own memory, which is taken off.
+ */
+static size_t glibcBaseline = 0;
+
+static size_t glibcFootprint() {
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd - glibcBaseline;
+}
+static int glibcInit() {
+    glibcBaseline = glibcFootprint();
+    return 0;
+}
+
+static const backend backends[] = {
+    { "heap",  heapInit,  allocHeap, heapRelease, reallocHeap, heapFootprint },
+    { "glibc", glibcInit, malloc,    free,        realloc,     glibcFootprint },
+};
+
+/*
+ * Writes value as an unsigned LEB128 varint.
+ */
+static void putVarint(FILE *out, size_t value) {
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    fputc((int)value, out);
+}
+
+/*
+ * Writes value as a varint padded to 10 bytes, so it can be overwritten.
+ */
+static void putFixedVarint(FILE *out, size_t value) {
+    unsigned long long rest = value;
+    int i;
+
+    for (i = 0; i < 9; i++) {
+        fputc((int)(rest & 0x7f) | 0x80, out);
+        rest >>= 7;
+    }
+    fputc((int)rest, out);
+}
+
+/*
+ * Reads an unsigned LEB128 varint.
+ * Returns 0 on success.
+ * Returns -1 on end of file or a malformed value.
+ */
+static int getVarint(FILE *in, size_t *value) {
+    unsigned long long result = 0;
+    int shift = 0;
+    int c;
+
+    do {
+        c = fgetc(in);
+        if (c == EOF || shift >= 70) {
+            return -1;
+        }
+        if (shift < 64) {
+            result |= (unsigned long long)(c & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (c & 0x80);
+
+    if (result > (size_t)-1) {
+        return -1;
+    }
+    *value = (size_t)result;
+    return 0;
+}
+
+/*
+ * Maps traced addresses to object ids, reusing the ids of freed objects.
+ * Open addressing with linear probing, deleted slots hold a tombstone.
+ */
+typedef struct idMap {
+    uintptr_t *keys;
+    size_t *ids;
+    size_t capacity;
+    size_t used;            // live and tombstone slots
+    size_t *freeIds;        // stack of reusable ids
+    size_t freeCount;
+    size_t freeCapacity;
+    size_t nextId;
+} idMap;
+
+#define EMPTY_KEY   ((uintptr_t)0)
+#define DEAD_KEY    ((uintptr_t)1)
+
+static size_t hashAddr(uintptr_t addr, size_t capacity) {
+    return (size_t)((addr >> 4) * 0x9E3779B97F4A7C15ull) & (capacity - 1);
+}
+
+static void* xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "heapTrace: out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/*
+ * Returns the slot of addr, or the slot where it would be inserted.
+ */
+static size_t findSlot(idMap *map, uintptr_t addr) {
+    size_t slot = hashAddr(addr, map->capacity);
+    size_t dead = map->capacity;
+
+    while (map->keys[slot] != EMPTY_KEY) {
+        if (map->keys[slot] == addr) {
+            return slot;
+        }
+        if (map->keys[slot] == DEAD_KEY && dead == map->capacity) {
+            dead = slot;
+        }
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+    return dead != map->capacity ? dead : slot;
+}
+
+static void growMap(idMap *map) {
+    uintptr_t *keys = map->keys;
+    size_t *ids = map->ids;
+    size_t capacity = map->capacity;
+    size_t i;
+
+    map->capacity = capacity ? capacity * 2 : 1024;
+    map->keys = xmalloc(map->capacity * sizeof(uintptr_t));
+    map->ids = xmalloc(map->capacity * sizeof(size_t));
+    memset(map->keys, 0, map->capacity * sizeof(uintptr_t));
+    map->used = 0;
+
+    for (i = 0; i < capacity; i++) {
+        if (keys[i] > DEAD_KEY) {
+            size_t slot = findSlot(map, keys[i]);
+            map->keys[slot] = keys[i];
+            map->ids[slot] = ids[i];
+            map->used++;
+        }
+    }
+    free(keys);
+    free(ids);
+}
+
+/*
+ * Maps addr to object id.
+ */
+static void putId(idMap *map, uintptr_t addr, size_t id) {
+    if ((map->used + 1) * 2 > map->capacity) {
+        growMap(map);
+    }
+    size_t slot = findSlot(map, addr);
+    if (map->keys[slot] == EMPTY_KEY) {
+        map->used++;
+    }
+    map->keys[slot] = addr;
+    map->ids[slot] = id;
+}
+
+/*
+ * Returns an unused object id.
+ */
+static size_t newId(idMap *map) {
+    return map->freeCount ? map->freeIds[--map->freeCount] : map->nextId++;
+}
+
+/*
+ * Makes object id available for reuse.
+ */
+static void releaseId(idMap *map, size_t id) {
+    if (map->freeCount == map->freeCapacity) {
+        map->freeCapacity = map->freeCapacity ? map->freeCapacity * 2 : 1024;
+        size_t *freeIds = xmalloc(map->freeCapacity * sizeof(size_t));
+        memcpy(freeIds, map->freeIds, map->freeCount * sizeof(size_t));
+        free(map->freeIds);
+        map->freeIds = freeIds;
+    }
+    map->freeIds[map->freeCount++] = id;
+}
+
+/*
+ * Removes addr and stores its object id in id.
+ * Returns 0 on success.
+ * Returns -1 if addr is not a live object.
+ */
+static int removeId(idMap *map, uintptr_t addr, size_t *id) {
+    if (map->capacity == 0 || addr <= DEAD_KEY) {
+        return -1;
+    }
+    size_t slot = findSlot(map, addr);
+    if (map->keys[slot] != addr) {
+        return -1;
+    }
+    *id = map->ids[slot];
+    map->keys[slot] = DEAD_KEY;
+    return 0;
+}
+
+/*
+ * Reads the value of a "returns ADDR" line.
+ * Returns 0 on success.
+ * Returns -1 if the next line is something else.
+ */
+static int readReturn(FILE *in, uintptr_t *addr) {
+    char line[256];
+    unsigned long long value;
+
+    if (fgets(line, sizeof(line), in) == NULL ||
+        sscanf(line, " returns %lli", (long long*)&value) != 1) {
+        return -1;
+    }
+    *addr = (uintptr_t)value;
+    return 0;
+}
+
+/*
+ * Writes a free for the object at addr if it is live, which happens
+ * when its free was not traced.
+ * Returns the number of records written.
+ */
+static size_t dropLive(idMap *map, uintptr_t addr, FILE *out) {
+    size_t id;
+
+    if (removeId(map, addr, &id) != 0) {
+        return 0;
+    }
+    releaseId(map, id);
+    putc(OP_FREE, out);
+    putVarint(out, id);
+    return 1;
+}
+
+/*
+ * Converts a malloctrace text trace to a binary trace.
+ * Frees of unknown addresses and failed allocations are dropped.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int record(const char *inName, const char *outName) {
+    FILE *in = fopen(inName, "r");
+    FILE *out = fopen(outName, "wb");
+    char line[256];
+    unsigned long long addr, size;
+    uintptr_t ret;
+    size_t id;
+    size_t ops = 0;
+    idMap map = { 0 };
+
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "heapTrace: cannot open %s\n", in == NULL ? inName : outName);
+        return -1;
+    }
+
+    // the header is written again once the counts are known
+    fputs("HTR1", out);
+    putFixedVarint(out, 0);
+    putFixedVarint(out, 0);
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (sscanf(line, "malloc(%lli)", (long long*)&size) == 1) {
+            if (readReturn(in, &ret) != 0 || ret == 0) {
+                continue;
+            }
+            ops += dropLive(&map, ret, out);
+            id = newId(&map);
+            putId(&map, ret, id);
+            putc(OP_MALLOC, out);
+            putVarint(out, id);
+            putVarint(out, (size_t)size);
+            ops++;
+        } else if (sscanf(line, "free(%lli)", (long long*)&addr) == 1) {
+            if (removeId(&map, (uintptr_t)addr, &id) != 0) {
+                continue;
+            }
+            releaseId(&map, id);
+            putc(OP_FREE, out);
+            putVarint(out, id);
+            ops++;
+        } else if (sscanf(line, "realloc(%lli, %lli)", (long long*)&addr, (long long*)&size) == 2) {
+            if (readReturn(in, &ret) != 0 || ret == 0 ||
+                removeId(&map, (uintptr_t)addr, &id) != 0) {
+                continue;
+            }
+            // the object keeps its id wherever it moved
+            ops += dropLive(&map, ret, out);
+            putId(&map, ret, id);
+            putc(OP_REALLOC, out);
+            putVarint(out, id);
+            putVarint(out, (size_t)size);
+            ops++;
+        }
+    }
+
+    rewind(out);
+    fputs("HTR1", out);
+    putFixedVarint(out, ops);
+    putFixedVarint(out, map.nextId);
+    fclose(in);
+    fclose(out);
+
+    printf("%lu operations on %lu object ids written to %s\n",
+           (unsigned long)ops, (unsigned long)map.nextId, outName);
+    return 0;
+}
+
+/*
+ * Reads a whole binary trace into memory.
+ * Returns the records, or NULL on failure.
+ */
+static traceOp* load(const char *name, size_t *ops, size_t *objects) {
+    FILE *in = fopen(name, "rb");
+    char magic[4];
+    size_t i;
+
+    if (in == NULL) {
+        fprintf(stderr, "heapTrace: cannot open %s\n", name);
+        return NULL;
+    }
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, "HTR1", 4) != 0 ||
+        getVarint(in, ops) != 0 || getVarint(in, objects) != 0) {
+        fprintf(stderr, "heapTrace: %s is not a trace\n", name);
+        fclose(in);
+        return NULL;
+    }
+
+    traceOp *trace = xmalloc((*ops + 1) * sizeof(traceOp));
+    for (i = 0; i < *ops; i++) {
+        int op = fgetc(in);
+        trace[i].op = (unsigned char)op;
+        trace[i].size = 0;
+        if (op < 0 || op >= OP_COUNT || getVarint(in, &trace[i].id) != 0 ||
+            trace[i].id >= *objects ||
+            (op != OP_FREE && getVarint(in, &trace[i].size) != 0)) {
+            fprintf(stderr, "heapTrace: %s is truncated at record %lu\n", name, (unsigned long)i);
+            fclose(in);
+            free(trace);
+            return NULL;
+        }
+    }
+    fclose(in);
+    return trace;
+}
+
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Prints latency percentiles of count samples, sorting them.
+ */
+static void printLatency(const char *name, uint32_t *lat, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    qsort(lat, count, sizeof(uint32_t), compareLatency);
+    printf("%-8s %10lu %8u %8u %8u %8u %10u\n", name, (unsigned long)count,
+           lat[count / 2], lat[count * 9 / 10], lat[count * 99 / 100],
+           lat[count * 999 / 1000], lat[count - 1]);
+}
+
+/*
+ * Replays a binary trace against one allocator and prints a report.
+ * Objects still live at the end are not freed.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int replay(const char *name, const backend *impl) {
+    size_t ops, objects, i;
+    traceOp *trace = load(name, &ops, &objects);
+    if (trace == NULL) {
+        return -1;
+    }
+    void **ptrs = xmalloc((objects + 1) * sizeof(void*));
+    size_t *sizes = xmalloc((objects + 1) * sizeof(size_t));
+    uint32_t *lat[OP_COUNT];
+    size_t latCount[OP_COUNT] = { 0 };
+    memset(ptrs, 0, (objects + 1) * sizeof(void*));
+    // sizes[id] stays 0 while ptrs[id] is NULL
+    memset(sizes, 0, (objects + 1) * sizeof(size_t));
+    for (i = 0; i < OP_COUNT; i++) {
+        lat[i] = xmalloc((ops + 1) * sizeof(uint32_t));
+    }
+    if (impl->init() != 0) {
+        fprintf(stderr, "heapTrace: cannot start %s\n", impl->name);
+        return -1;
+    }
+
+    size_t live = 0, peakLive = 0, footprint, peakFootprint = 0, failed = 0;
+    size_t every = ops / SAMPLES ? ops / SAMPLES : 1;
+    long long total = 0;
+
+    printf("replaying %lu operations on %s\n", (unsigned long)ops, impl->name);
+    printf("%10s %14s %14s %8s\n", "op", "live bytes", "footprint", "util");
+
+    for (i = 0; i < ops; i++) {
+        traceOp *t = &trace[i];
+        long long start = nowNs();
+
+        switch (t->op) {
+        case OP_MALLOC:
+            ptrs[t->id] = impl->alloc(t->size);
+            break;
+        case OP_FREE:
+            impl->release(ptrs[t->id]);
+            break;
+        case OP_REALLOC: {
+            void *ptr = impl->resize(ptrs[t->id], t->size);
+            if (ptr != NULL || t->size == 0) {
+                ptrs[t->id] = ptr;
+            }
+            break;
+        }
+        }
+
+        long long elapsed = nowNs() - start;
+        total += elapsed;
+        lat[t->op][latCount[t->op]++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+
+        // bookkeeping outside the timed region
+        switch (t->op) {
+        case OP_MALLOC:
+            if (ptrs[t->id] == NULL) {
+                sizes[t->id] = 0;
+                failed++;
+                break;
+            }
+            sizes[t->id] = t->size;
+            live += t->size;
+            break;
+        case OP_FREE:
+            live -= sizes[t->id];
+            ptrs[t->id] = NULL;
+            sizes[t->id] = 0;
+            break;
+        case OP_REALLOC:
+            if (ptrs[t->id] == NULL && t->size != 0) {
+                failed++;
+                break;
+            }
+            live = live - sizes[t->id] + t->size;
+            sizes[t->id] = t->size;
+            break;
+        }
+        if (live > peakLive) {
+            peakLive = live;
+        }
+        if (i % every == every - 1 || i == ops - 1) {
+            footprint = impl->footprint();
+            if (footprint > peakFootprint) {
+                peakFootprint = footprint;
+            }
+            printf("%10lu %14lu %14lu %7.1f%%\n", (unsigned long)(i + 1), (unsigned long)live,
+                   (unsigned long)footprint, footprint ? 100.0 * live / footprint : 0.0);
+        }
+    }
+
+    printf("\n%lu operations in %.3f ms, %.2f Mops/s, %lu failed\n", (unsigned long)ops,
+           total / 1e6, total ? ops * 1e3 / total : 0.0, (unsigned long)failed);
+    printf("peak live bytes %lu, peak sampled footprint %lu, utilization %.1f%%\n",
+           (unsigned long)peakLive, (unsigned long)peakFootprint,
+           peakFootprint ? 100.0 * peakLive / peakFootprint : 0.0);
+    printf("\n%-8s %10s %8s %8s %8s %8s %10s   (ns)\n",
+           "op", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < OP_COUNT; i++) {
+        printLatency(opNames[i], lat[i], latCount[i]);
+        free(lat[i]);
+    }
+
+    free(ptrs);
+    free(sizes);
+    free(trace);
+    return 0;
+}
+
+static int usage() {
+    fprintf(stderr, "Usage: heapTrace record <malloctrace.out> <trace>\n"
+                    "       heapTrace replay <trace> [heap|glibc]\n");
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "record") == 0) {
+        return record(argv[2], argv[3]) == 0 ? 0 : 1;
+    }
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "replay") == 0) {
+        const char *impl = argc == 4 ? argv[3] : "heap";
+        for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+            if (strcmp(impl, backends[i].name) == 0) {
+                return replay(argv[2], &backends[i]) == 0 ? 0 : 1;
+            }
+        }
+    }
+    return usage();
+}
@@ -0,0 +1,37 @@
+// aligned allocations return the leading slack to the free list
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "heapAlloc.h"
+
+int main() {
+   assert(initHeap(4096) == 0);
+   void* ptr[4];
+
+   ptr[0] = allocHeap(4);
+   assert(ptr[0] != NULL);
+
+   ptr[1] = allocHeapAligned(100, 64);
+   assert(ptr[1] != NULL);
+   assert(((uintptr_t)ptr[1]) % 64 == 0);
+
+   ptr[2] = allocHeapAligned(32, 32);
+   assert(ptr[2] != NULL);
+   assert(((uintptr_t)ptr[2]) % 32 == 0);
+
+   // slack in front of the first aligned block is free for reuse
+   ptr[3] = allocHeap(4);
+   assert(ptr[3] != NULL);
+
+   assert(allocHeapAligned(8, 24) == NULL);
+
+   for (int i = 0; i < 4; i++)
+      assert(freeHeap(ptr[i]) == 0);
+
+   // whole heap coalesced again
+   ptr[0] = allocHeapAligned(2048, 1024);
+   assert(ptr[0] != NULL);
+   assert(((uintptr_t)ptr[0]) % 1024 == 0);
+
+   exit(0);
+}
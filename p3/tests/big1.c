@@ -0,0 +1,34 @@
+// heaps and blocks larger than 2 GB in 64-bit builds
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "heapAlloc.h"
+
+int main() {
+   if (sizeof(void*) == 4)
+      exit(0);
+
+   size_t gb = (size_t)1 << 30;
+   assert(initHeapGrowable(4 * gb) == 0);
+
+   char* ptr[2];
+   ptr[0] = allocHeap(3 * gb);
+   assert(ptr[0] != NULL);
+   assert(((uintptr_t)ptr[0]) % 16 == 0);
+   ptr[0][3 * gb - 1] = 1;
+   assert(sizeHeap(ptr[0]) >= 3 * gb);
+
+   // needs an arena of its own
+   ptr[1] = allocHeap(5 * gb);
+   assert(ptr[1] != NULL);
+   ptr[1][5 * gb - 1] = 1;
+
+   assert(freeHeap(ptr[1]) == 0);
+   assert(freeHeap(ptr[0]) == 0);
+
+   heapInfo info;
+   heapStats(&info);
+   // HEAP_HARDEN builds still hold the freed blocks in the quarantine
+   assert(info.bytes_used == info.quarantine_bytes);
+   exit(0);
+}
@@ -3,7 +3,12 @@
 #include <stdlib.h>
 #include "heapAlloc.h"
 
+#ifdef HEAP_HARDEN
+// header, canary word and alignment of an 884 byte block in 64-bit builds
+#define HEADER (28)
+#else
 #define HEADER (4)
+#endif
 #define SLACK (8)
 
 int main() {
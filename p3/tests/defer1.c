@@ -0,0 +1,67 @@
+// deferred frees are reused by size, coalesced in batches and flushed
+#include <assert.h>
+#include <stdlib.h>
+#include "heapAlloc.h"
+
+int main() {
+   heapInfo info;
+   assert(initHeap(4096) == 0);
+   deferFreeHeap(1);
+
+   void* ptr[4];
+   ptr[0] = allocHeap(8);
+   ptr[1] = allocHeap(8);
+   ptr[2] = allocHeap(100);
+   ptr[3] = allocHeap(100);
+   assert(freeHeap(ptr[1]) == 0);
+   assert(freeHeap(ptr[1]) == -1);
+   assert(sizeHeap(ptr[1]) == 0);
+
+   // queued blocks still count as used until coalesced,
+   // HEAP_HARDEN builds quarantine them before they are queued
+#ifndef HEAP_HARDEN
+   heapStats(&info);
+   assert(info.deferred_blocks == 1);
+   assert(info.free_blocks == 1);
+   assert(allocHeap(8) == ptr[1]);
+#else
+   assert((ptr[1] = allocHeap(8)) != NULL);
+#endif
+
+   void* batch[3] = { ptr[0], ptr[1], NULL };
+   assert(freeHeapBatch(batch, 3) == -1);
+#ifndef HEAP_HARDEN
+   heapStats(&info);
+   assert(info.deferred_blocks == 0);
+   assert(info.free_blocks == 2);
+#endif
+
+   assert(freeHeap(ptr[2]) == 0);
+   assert(freeHeap(ptr[3]) == 0);
+#ifndef HEAP_HARDEN
+   heapStats(&info);
+   assert(info.deferred_blocks == 2);
+#endif
+   deferFreeHeap(0);
+   heapStats(&info);
+   assert(info.deferred_blocks == 0);
+   assert(info.bytes_used == info.quarantine_bytes);
+#ifdef HEAP_HARDEN
+   // a request no block can hold drains the quarantine
+   assert(allocHeap(4096) == NULL);
+   heapStats(&info);
+#endif
+   assert(info.bytes_used == 0);
+   assert(info.free_blocks == 1);
+
+   // a full heap coalesces the queue before giving up
+   deferFreeHeap(1);
+   ptr[0] = allocHeap(2000);
+   ptr[1] = allocHeap(1900);
+   assert(ptr[0] != NULL && ptr[1] != NULL);
+   assert(freeHeap(ptr[0]) == 0);
+   assert(freeHeap(ptr[1]) == 0);
+   assert(allocHeap(3900) != NULL);
+
+   exit(0);
+}
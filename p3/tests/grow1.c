@@ -0,0 +1,32 @@
+// growable heap maps more arenas when full and reuses freed space
+#include <assert.h>
+#include <stdlib.h>
+#include "heapAlloc.h"
+
+int main() {
+   assert(initHeapGrowable(4096) == 0);
+   void* ptr[32];
+
+   for (int i = 0; i < 32; i++) {
+      ptr[i] = allocHeap(800);
+      assert(ptr[i] != NULL);
+      *(int*)ptr[i] = i;
+   }
+   for (int i = 0; i < 32; i++)
+      assert(*(int*)ptr[i] == i);
+
+   // larger than an arena
+   void* big = allocHeap(3 * 4096);
+   assert(big != NULL);
+   assert(freeHeap(big) == 0);
+
+   for (int i = 31; i >= 0; i--)
+      assert(freeHeap(ptr[i]) == 0);
+
+   ptr[0] = allocHeap(800);
+   assert(ptr[0] != NULL);
+   assert(freeHeap(ptr[0]) == 0);
+   assert(freeHeap(ptr[0]) == -1);
+
+   exit(0);
+}
@@ -0,0 +1,35 @@
+// many arenas are found by address and released in any order
+#include <assert.h>
+#include <stdlib.h>
+#include "heapAlloc.h"
+
+int main() {
+   assert(initHeapGrowable(4096) == 0);
+   void* ptr[600];
+
+   // each allocation is too large to share an arena
+   for (int i = 0; i < 600; i++) {
+      ptr[i] = allocHeap(3000 + i);
+      assert(ptr[i] != NULL);
+   }
+   for (int i = 0; i < 600; i++)
+      assert(sizeHeap(ptr[i]) >= (size_t)(3000 + i));
+
+   // a pointer between arenas belongs to none
+   int x;
+   assert(sizeHeap(&x) == 0);
+   assert(freeHeap(&x) == -1);
+
+   for (int i = 0; i < 600; i += 2)
+      assert(freeHeap(ptr[i]) == 0);
+   assert(checkHeap() == 0);
+   for (int i = 599; i > 0; i -= 2)
+      assert(freeHeap(ptr[i]) == 0);
+   assert(checkHeap() == 0);
+
+   ptr[0] = allocHeap(3000);
+   assert(ptr[0] != NULL);
+   assert(freeHeap(ptr[0]) == 0);
+
+   exit(0);
+}
@@ -0,0 +1,48 @@
+// misaligned and freed pointers are rejected, heap walks find corruption
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "heapAlloc.h"
+
+int main() {
+   assert(initHeap(4096) == 0);
+   char* ptr[3];
+   ptr[0] = allocHeap(40);
+   ptr[1] = allocHeap(40);
+   ptr[2] = allocHeap(40);
+   assert(checkHeap() == 0);
+
+   assert(freeHeap(ptr[1] + 4) == -1);
+   assert(freeHeap(ptr[1]) == 0);
+   assert(freeHeap(ptr[1]) == -1);
+   assert(checkHeap() == 0);
+
+#ifdef HEAP_HARDEN
+   // a one byte overflow is caught when the block is freed
+   pid_t pid = fork();
+   if (pid == 0) {
+      close(2);
+      ptr[0][40] = 0;
+      freeHeap(ptr[0]);
+      exit(0);
+   }
+   int status;
+   waitpid(pid, &status, 0);
+   assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+   assert(sizeHeap(ptr[0]) == 40);
+#endif
+
+   // an overwritten footer breaks the heap walk
+   assert(freeHeap(ptr[2]) == 0);
+   assert(freeHeap(ptr[0]) == 0);
+   assert(checkHeap() == 0);
+   void* big = allocHeap(2000);
+   memset(big, 0, 2000);
+   memset((char*)big + 2000, 0xff, 64);
+   assert(checkHeap() == -1);
+
+   exit(0);
+}
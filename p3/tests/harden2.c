@@ -0,0 +1,35 @@
+// deferred frees of blocks smaller than a free list link keep the heap valid
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heapAlloc.h"
+
+int main() {
+   assert(initHeap(1 << 20) == 0);
+   deferFreeHeap(1);
+
+   // enough to push blocks through the quarantine into the deferred queue
+   void* ptr[300];
+   for (int i = 0; i < 300; i++) {
+      ptr[i] = allocHeap(4);
+      assert(ptr[i] != NULL);
+      memset(ptr[i], i, 4);
+   }
+   for (int i = 0; i < 300; i++)
+      assert(freeHeap(ptr[i]) == 0);
+   assert(checkHeap() == 0);
+
+   // queued blocks reused by size get a fresh canary
+   for (int i = 0; i < 300; i++) {
+      ptr[i] = allocHeap(4);
+      assert(ptr[i] != NULL);
+   }
+   assert(checkHeap() == 0);
+   for (int i = 0; i < 300; i++)
+      assert(freeHeap(ptr[i]) == 0);
+
+   deferFreeHeap(0);
+   assert(checkHeap() == 0);
+
+   exit(0);
+}
@@ -0,0 +1,26 @@
+// huge page arenas are whole 2 MB pages and fall back when none are reserved
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "heapAlloc.h"
+
+int main() {
+   heapInfo info;
+   assert(hugePagesHeap(3) == -1);
+   assert(hugePagesHeap(HEAP_PAGES_HUGETLB) == 0);
+   assert(initHeap(4096) == 0);
+
+   heapStats(&info);
+   size_t heap_size = info.bytes_used + info.bytes_free;
+   assert(heap_size > 2 * 1024 * 1024 - 64);
+   assert(heap_size < 2 * 1024 * 1024);
+   assert(info.huge_bytes == 0 || info.huge_bytes == 2 * 1024 * 1024);
+
+   void* ptr = allocHeap(1024 * 1024);
+   assert(ptr != NULL);
+   assert((uintptr_t)ptr % (2 * 1024 * 1024) < 64);
+   assert(allocHeap(1024 * 1024) == NULL);
+   assert(freeHeap(ptr) == 0);
+
+   exit(0);
+}
@@ -0,0 +1,26 @@
+// NUMA awareness is chosen before init and reports at least one node
+#include <assert.h>
+#include <stdlib.h>
+#include "heapAlloc.h"
+
+int main() {
+   heapInfo info;
+   assert(numaHeap(1) == 0);
+   assert(initHeapGrowable(4096) == 0);
+   assert(numaHeap(0) == -1);
+
+   void* ptr[8];
+   for (int i = 0; i < 8; i++)
+      assert((ptr[i] = allocHeap(1000)) != NULL);
+   for (int i = 0; i < 8; i++)
+      assert(freeHeap(ptr[i]) == 0);
+
+   heapStats(&info);
+   assert(info.numa_nodes >= 1);
+   assert(info.remote_frees <= info.free_count);
+   // HEAP_HARDEN builds still hold the freed blocks in the quarantine
+   assert(info.bytes_used == info.quarantine_bytes);
+   assert(checkHeap() == 0);
+
+   exit(0);
+}
@@ -0,0 +1,41 @@
+// realloc grows and shrinks in place when neighbors allow it
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heapAlloc.h"
+
+int main() {
+   assert(initHeap(4096) == 0);
+   void* ptr[3];
+
+   ptr[0] = allocHeap(100);
+   assert(ptr[0] != NULL);
+   memset(ptr[0], 'a', 100);
+
+   // next block is free, grow in place
+   ptr[1] = reallocHeap(ptr[0], 1000);
+   assert(ptr[1] == ptr[0]);
+
+   // shrink in place
+   ptr[1] = reallocHeap(ptr[1], 50);
+   assert(ptr[1] == ptr[0]);
+   for (int i = 0; i < 50; i++)
+      assert(((char*)ptr[1])[i] == 'a');
+
+   // blocked by an allocated neighbor, must move
+   ptr[2] = allocHeap(100);
+   assert(ptr[2] != NULL);
+   ptr[0] = allocHeap(16);
+   assert(ptr[0] != NULL);
+   memset(ptr[2], 'b', 100);
+   ptr[1] = reallocHeap(ptr[2], 2000);
+   assert(ptr[1] != NULL && ptr[1] != ptr[2]);
+   for (int i = 0; i < 100; i++)
+      assert(((char*)ptr[1])[i] == 'b');
+
+   // too big for the heap, original block kept
+   assert(reallocHeap(ptr[1], 8192) == NULL);
+   assert(freeHeap(ptr[1]) == 0);
+
+   exit(0);
+}
@@ -0,0 +1,48 @@
+// small objects pack densely and still coalesce when freed
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "heapAlloc.h"
+
+#define COUNT 100
+
+int main() {
+   assert(initHeap(8192) == 0);
+   heapInfo info;
+   char* ptr[COUNT];
+
+   for (int i = 0; i < COUNT; i++) {
+      ptr[i] = allocHeap(8);
+      assert(ptr[i] != NULL);
+      memset(ptr[i], i, 8);
+   }
+
+   // one header plus eight bytes, and the HEAP_HARDEN canary,
+   // rounded up to the alignment
+   heapStats(&info);
+#if (defined(HEAP_COMPACT) && !defined(HEAP_HARDEN)) || !defined(__LP64__)
+   assert(info.bytes_used == COUNT * 16);
+#else
+   assert(info.bytes_used == COUNT * 32);
+#endif
+
+   for (int i = 0; i < COUNT; i += 2)
+      assert(freeHeap(ptr[i]) == 0);
+   for (int i = 1; i < COUNT; i += 2) {
+      for (int j = 0; j < 8; j++)
+         assert(ptr[i][j] == i);
+      assert(freeHeap(ptr[i]) == 0);
+   }
+
+   heapStats(&info);
+   // HEAP_HARDEN builds still hold the freed blocks in the quarantine
+   assert(info.bytes_used == info.quarantine_bytes);
+#ifdef HEAP_HARDEN
+   // a request no block can hold drains the quarantine
+   assert(allocHeap(8192) == NULL);
+   heapStats(&info);
+#endif
+   assert(info.bytes_used == 0);
+   assert(info.free_blocks == 1);
+   exit(0);
+}
@@ -0,0 +1,51 @@
+// statistics track allocations, frees and free space without a heap walk
+#include <assert.h>
+#include <stdlib.h>
+#include "heapAlloc.h"
+
+// a request no block can hold drains the HEAP_HARDEN quarantine
+#ifdef HEAP_HARDEN
+#define DRAIN() assert(allocHeap(4096) == NULL)
+#else
+#define DRAIN()
+#endif
+
+int main() {
+   heapInfo info;
+   assert(initHeap(4096) == 0);
+   heapStats(&info);
+   assert(info.bytes_used == 0);
+   assert(info.free_blocks == 1);
+   assert(info.largest_free == info.bytes_free);
+   assert(info.fragmentation == 0.0);
+   size_t heap_size = info.bytes_free;
+
+   void* ptr[3];
+   ptr[0] = allocHeap(100);
+   ptr[1] = allocHeap(100);
+   ptr[2] = allocHeap(100);
+   assert(freeHeap(ptr[1]) == 0);
+   DRAIN();
+
+   heapStats(&info);
+   assert(info.alloc_count == 3);
+   assert(info.free_count == 1);
+   assert(info.free_blocks == 2);
+   assert(info.bytes_used + info.bytes_free == heap_size);
+   assert(info.largest_free < info.bytes_free);
+   assert(info.fragmentation > 0.0);
+
+   size_t counted = 0;
+   for (int i = 0; i < 32; i++)
+      counted += info.free_by_class[i];
+   assert(counted == info.free_blocks);
+
+   assert(freeHeap(ptr[0]) == 0);
+   assert(freeHeap(ptr[2]) == 0);
+   DRAIN();
+   heapStats(&info);
+   assert(info.bytes_used == 0);
+   assert(info.free_blocks == 1);
+
+   exit(0);
+}
@@ -30,26 +30,294 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 END_LEGAL */
 /*
  *  This file contains an ISA-portable PIN tool for tracing memory accesses.
+ *
+ *  The accesses are collected in the per thread buffers of the buffering
+ *  API with the time stamp counter at each one. When a buffer fills, the
+ *  thread encodes it into large blocks in the format of pinatrace.H, and
+ *  a tool thread writes the full blocks, LZ compressing them with
+ *  -compress, to a shard file of that thread alone, <o>.<n> for the n-th
+ *  thread started. At exit the shards are merged in time stamp order into
+ *  the text trace <o>. With -binary they are kept instead and <o> lists
+ *  them; pinatrace_merge prints them as one trace and pinatrace_decode
+ *  prints a single one.
  */
 
 #include <stdio.h>
+#include <list>
+#include <set>
+#include <vector>
 #include "pin.H"
+#include "pinatrace.H"
 
 
-FILE * trace;
+/* ===================================================================== */
+/* Commandline Switches */
+/* ===================================================================== */
+
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
+    "o", "pinatrace.out", "specify trace file name");
+KNOB<BOOL> KnobBinary(KNOB_MODE_WRITEONCE, "pintool",
+    "binary", "0", "keep the binary trace of every thread, listed in the trace file");
+KNOB<BOOL> KnobCompress(KNOB_MODE_WRITEONCE, "pintool",
+    "compress", "0", "LZ compress the blocks of a binary trace");
+KNOB<UINT32> KnobBufferPages(KNOB_MODE_WRITEONCE, "pintool",
+    "buffer_pages", "256", "pages in the trace buffer of each thread");
+
+/* ===================================================================== */
+/* Trace buffer */
+/* ===================================================================== */
+
+struct MEMREF
+{
+    ADDRINT ip;
+    ADDRINT ea;
+    UINT64 tsc;
+    BOOL isWrite;
+};
+
+BUFFER_ID bufId;
+
+/* ===================================================================== */
+/* Shards */
+/* ===================================================================== */
+
+/*!
+ *  @brief Blocks passed between the application threads and the writer
+ */
+class BLOCK_QUEUE
+{
+  private:
+    struct BLOCK
+    {
+        UINT8 * data;
+        UINT32 size;
+        VOID * owner;
+    };
+
+    std::list<BLOCK> _blocks;
+    PIN_LOCK _lock;
+    PIN_SEMAPHORE _ready;
+    BOOL _closed;
+    BOOL _done;
+
+  public:
+    BLOCK_QUEUE() : _closed(false), _done(false)
+    {
+        PIN_InitLock(&_lock);
+        PIN_SemaphoreInit(&_ready);
+    }
+
+    ~BLOCK_QUEUE()
+    {
+        PIN_SemaphoreFini(&_ready);
+    }
+
+    /// @return false once Get has returned 0
+    BOOL Put(UINT8 * data, UINT32 size, VOID * owner = 0)
+    {
+        PIN_GetLock(&_lock, PIN_ThreadId() + 1);
+        const BOOL done = _done;
+        if (! done)
+        {
+            const BLOCK block = { data, size, owner };
+            _blocks.push_back(block);
+            PIN_SemaphoreSet(&_ready);
+        }
+        PIN_ReleaseLock(&_lock);
+        return ! done;
+    }
+
+    /// waits for a block; 0 once the queue is closed and empty
+    UINT8 * Get(UINT32 & size, VOID *& owner)
+    {
+        for (;;)
+        {
+            PIN_GetLock(&_lock, PIN_ThreadId() + 1);
+            if (! _blocks.empty())
+            {
+                UINT8 * data = _blocks.front().data;
+                size = _blocks.front().size;
+                owner = _blocks.front().owner;
+                _blocks.pop_front();
+                PIN_ReleaseLock(&_lock);
+                return data;
+            }
+            if (_closed)
+            {
+                _done = true;
+                PIN_ReleaseLock(&_lock);
+                return 0;
+            }
+            PIN_SemaphoreClear(&_ready);
+            PIN_ReleaseLock(&_lock);
+
+            PIN_SemaphoreWait(&_ready);
+        }
+    }
+
+    VOID Close()
+    {
+        PIN_GetLock(&_lock, PIN_ThreadId() + 1);
+        _closed = true;
+        PIN_SemaphoreSet(&_ready);
+        PIN_ReleaseLock(&_lock);
+    }
+};
+
+// full blocks of all the shards, in the order they were filled
+BLOCK_QUEUE * fullBlocks;
+
+PIN_THREAD_UID writerUid;
+
+// compressed block of the writer
+UINT8 * compressed;
+
+/*!
+ *  @brief The trace file of one application thread. The thread encodes
+ *  into one block while the writer writes the other.
+ */
+class SHARD
+{
+  private:
+    static const UINT32 NUM_BLOCKS = 2;
+
+    FILE * _file;
+    UINT8 * _blocks[NUM_BLOCKS];
+    BLOCK_QUEUE _freeBlocks;
+    PINATRACE::ENCODER _encoder;
+
+  public:
+    SHARD(FILE * file) : _file(file)
+    {
+        fwrite(PINATRACE::MAGIC, 1, sizeof(PINATRACE::MAGIC), _file);
+
+        for (UINT32 i = 0; i < NUM_BLOCKS; i++) _blocks[i] = new UINT8[PINATRACE::BLOCK_SIZE];
+        for (UINT32 i = 1; i < NUM_BLOCKS; i++) _freeBlocks.Put(_blocks[i], 0);
+        _encoder.Reset(_blocks[0]);
+    }
+
+    ~SHARD()
+    {
+        for (UINT32 i = 0; i < NUM_BLOCKS; i++) delete [] _blocks[i];
+    }
+
+    /// called by the writer, with scratch space for compressing
+    VOID Write(const UINT8 * data, UINT32 size, UINT8 * scratch)
+    {
+        const UINT32 storedSize = (KnobCompress ? PINATRACE::Compress(data, size, scratch, size) : 0);
+        UINT8 header[PINATRACE::HEADER_SIZE];
+
+        if (storedSize != 0)
+        {
+            PINATRACE::PutHeader(header, size, storedSize, PINATRACE::STORAGE_LZ);
+            fwrite(header, 1, sizeof(header), _file);
+            fwrite(scratch, 1, storedSize, _file);
+        }
+        else
+        {
+            PINATRACE::PutHeader(header, size, size, PINATRACE::STORAGE_RAW);
+            fwrite(header, 1, sizeof(header), _file);
+            fwrite(data, 1, size, _file);
+        }
+    }
+
+    /// called by the writer after the last block
+    VOID Close()
+    {
+        UINT8 header[PINATRACE::HEADER_SIZE];
+
+        PINATRACE::PutHeader(header, 0, 0, PINATRACE::STORAGE_RAW);
+        fwrite(header, 1, sizeof(header), _file);
+        fclose(_file);
+    }
+
+    VOID Put(const MEMREF & ref)
+    {
+        _encoder.Put(ref.ip, ref.ea, ref.isWrite, ref.tsc);
+        if (_encoder.Full()) Flush();
+    }
+
+    /// passes the block being encoded to the writer
+    VOID Flush()
+    {
+        UINT8 * data = _encoder.Block();
+        UINT32 size;
+        VOID * owner;
+
+        // once the writer has stopped, the process is exiting: write here
+        if (fullBlocks->Put(data, _encoder.Size(), this))
+        {
+            data = _freeBlocks.Get(size, owner);
+        }
+        else
+        {
+            UINT8 * scratch = new UINT8[PINATRACE::BLOCK_SIZE];
+            Write(data, _encoder.Size(), scratch);
+            delete [] scratch;
+        }
+        _encoder.Reset(data);
+    }
 
-// Print a memory read record
-VOID RecordMemRead(VOID * ip, VOID * addr)
+    /// passes the last block and the end of the shard to the writer
+    VOID End()
+    {
+        if (_encoder.Size() != 0) Flush();
+
+        // an empty block asks the writer to close and delete the shard
+        if (! fullBlocks->Put(_encoder.Block(), 0, this))
+        {
+            Close();
+            delete this;
+        }
+    }
+
+    /// called by the writer for the blocks of Flush and End
+    VOID Written(UINT8 * data, UINT32 size)
+    {
+        if (size != 0)
+        {
+            _freeBlocks.Put(data, 0);
+        }
+        else
+        {
+            Close();
+            delete this;
+        }
+    }
+};
+
+TLS_KEY shardKey;
+
+// thread and file of every shard, in the order the threads started;
+// thread ids are reused, so the files are named by that order
+std::vector<std::pair<THREADID, string> > shardFiles;
+std::set<SHARD *> liveShards;
+PIN_LOCK shardLock;
+
+VOID WriterThread(VOID * arg)
 {
-    fprintf(trace,"%p: R %p\n", ip, addr);
+    UINT32 size;
+    VOID * owner;
+
+    while (UINT8 * data = fullBlocks->Get(size, owner))
+    {
+        SHARD * shard = static_cast<SHARD *>(owner);
+
+        if (size != 0) shard->Write(data, size, compressed);
+        shard->Written(data, size);
+    }
 }
 
-// Print a memory write record
-VOID RecordMemWrite(VOID * ip, VOID * addr)
+VOID PrepareForFini(VOID *v)
 {
-    fprintf(trace,"%p: W %p\n", ip, addr);
+    fullBlocks->Close();
+    PIN_WaitForThreadTermination(writerUid, PIN_INFINITE_TIMEOUT, NULL);
 }
 
+/* ===================================================================== */
+/* Instrumentation */
+/* ===================================================================== */
+
 // Is called for every instruction and instruments reads and writes
 VOID Instruction(INS ins, VOID *v)
 {
@@ -63,31 +331,129 @@ VOID Instruction(INS ins, VOID *v)
     // Iterate over each memory operand of the instruction.
     for (UINT32 memOp = 0; memOp < memOperands; memOp++)
     {
-        if (INS_MemoryOperandIsRead(ins, memOp))
-        {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_END);
-        }
         // Note that in some architectures a single memory operand can be 
         // both read and written (for instance incl (%eax) on IA-32)
         // In that case we instrument it once for read and once for write.
-        if (INS_MemoryOperandIsWritten(ins, memOp))
+        for (UINT32 isWrite = 0; isWrite < 2; isWrite++)
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_END);
+            if (isWrite ? INS_MemoryOperandIsWritten(ins, memOp) : INS_MemoryOperandIsRead(ins, memOp))
+            {
+                INS_InsertFillBufferPredicated(
+                    ins, IPOINT_BEFORE, bufId,
+                    IARG_INST_PTR, offsetof(MEMREF, ip),
+                    IARG_MEMORYOP_EA, memOp, offsetof(MEMREF, ea),
+                    IARG_TSC, offsetof(MEMREF, tsc),
+                    IARG_BOOL, isWrite, offsetof(MEMREF, isWrite),
+                    IARG_END);
+            }
         }
     }
 }
 
+/*!
+ *  Called when the buffer of a thread fills up, or the thread exits,
+ *  to encode its records into the shard of the thread.
+ */
+VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
+                  UINT64 numElements, VOID *v)
+{
+    SHARD * shard = static_cast<SHARD *>(PIN_GetThreadData(shardKey, tid));
+    const MEMREF * ref = static_cast<const MEMREF *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++) shard->Put(ref[i]);
+
+    return buf;
+}
+
+/*
+ *  Note that opening a file in a callback is only supported on Linux systems.
+ */
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    PIN_GetLock(&shardLock, tid + 1);
+    const string name = KnobOutputFile.Value() + "." + decstr(UINT32(shardFiles.size()));
+    FILE * file = fopen(name.c_str(), "wb");
+
+    if (file == NULL)
+    {
+        PIN_ReleaseLock(&shardLock);
+        PIN_ERROR("cannot open " + name + "\n");
+        PIN_ExitProcess(1);
+    }
+
+    SHARD * shard = new SHARD(file);
+    shardFiles.push_back(std::make_pair(tid, name));
+    liveShards.insert(shard);
+    PIN_ReleaseLock(&shardLock);
+
+    PIN_SetThreadData(shardKey, shard, tid);
+}
+
+VOID EndShard(SHARD * shard)
+{
+    PIN_GetLock(&shardLock, PIN_ThreadId() + 1);
+    liveShards.erase(shard);
+    PIN_ReleaseLock(&shardLock);
+
+    shard->End();
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    EndShard(static_cast<SHARD *>(PIN_GetThreadData(shardKey, tid)));
+    PIN_SetThreadData(shardKey, 0, tid);
+}
+
+VOID PrintText(size_t shard, const PINATRACE::RECORD & record, VOID * arg)
+{
+    fprintf(static_cast<FILE *>(arg), "%p: %c %p\n", Addrint2VoidStar(record.ip),
+            record.isWrite ? 'W' : 'R', Addrint2VoidStar(record.ea));
+}
+
 VOID Fini(INT32 code, VOID *v)
 {
-    fprintf(trace, "#eof\n");
+    // threads still running at exit end their shards here
+    while (! liveShards.empty()) EndShard(*liveShards.begin());
+
+    FILE * trace = fopen(KnobOutputFile.Value().c_str(), "w");
+    if (trace == NULL)
+    {
+        PIN_ERROR("cannot open " + KnobOutputFile.Value() + "\n");
+        return;
+    }
+
+    if (KnobBinary)
+    {
+        fprintf(trace, "#pinatrace shards\n");
+        for (size_t i = 0; i < shardFiles.size(); i++)
+        {
+            fprintf(trace, "%u %s\n", shardFiles[i].first, shardFiles[i].second.c_str());
+        }
+        fclose(trace);
+        return;
+    }
+
+    std::vector<PINATRACE::SHARD_READER *> shards;
+    for (size_t i = 0; i < shardFiles.size(); i++)
+    {
+        shards.push_back(new PINATRACE::SHARD_READER);
+        shards.back()->Open(shardFiles[i].second.c_str());
+    }
+
+    PINATRACE::Merge(shards, PrintText, trace);
+
+    BOOL complete = true;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (shards[i]->Error() != 0)
+        {
+            PIN_ERROR(shardFiles[i].second + " " + shards[i]->Error() + "\n");
+            complete = false;
+        }
+        delete shards[i];
+        remove(shardFiles[i].second.c_str());
+    }
+    if (complete) fprintf(trace, "#eof\n");
     fclose(trace);
 }
 
@@ -110,9 +476,29 @@ int main(int argc, char *argv[])
 {
     if (PIN_Init(argc, argv)) return Usage();
 
-    trace = fopen("pinatrace.out", "w");
+    bufId = PIN_DefineTraceBuffer(sizeof(MEMREF), KnobBufferPages, BufferFull, 0);
+    if (bufId == BUFFER_ID_INVALID)
+    {
+        PIN_ERROR("cannot allocate the trace buffer\n");
+        return 1;
+    }
+
+    shardKey = PIN_CreateThreadDataKey(0);
+    PIN_InitLock(&shardLock);
+
+    fullBlocks = new BLOCK_QUEUE;
+    compressed = new UINT8[PINATRACE::BLOCK_SIZE];
+
+    if (PIN_SpawnInternalThread(WriterThread, NULL, 0, &writerUid) == INVALID_THREADID)
+    {
+        PIN_ERROR("cannot start the trace writer thread\n");
+        return 1;
+    }
 
     INS_AddInstrumentFunction(Instruction, 0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -0,0 +1,78 @@
+/*BEGIN_LEGAL 
+Intel Open Source License 
+
+Copyright (c) 2002-2017 Intel Corporation. All rights reserved.
+ 
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.  Redistributions
+in binary form must reproduce the above copyright notice, this list of
+conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.  Neither the name of
+the Intel Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without
+specific prior written permission.
+ 
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE INTEL OR
+ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+END_LEGAL */
+/*
+ *  Prints one shard of a trace written by pinatrace -binary, the accesses
+ *  of one thread, in the text form pinatrace writes without -binary.
+ *
+ *  Usage: pinatrace_decode <shard> [<text trace>]
+ *  The text trace defaults to standard output.
+ */
+
+#include <stdio.h>
+#include "pinatrace.H"
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: pinatrace_decode <shard> [<text trace>]\n");
+        return 1;
+    }
+
+    FILE * out = (argc > 2 ? fopen(argv[2], "w") : stdout);
+    if (out == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", argv[2]);
+        return 1;
+    }
+
+    PINATRACE::SHARD_READER shard;
+    PINATRACE::RECORD record;
+
+    if (shard.Open(argv[1]))
+    {
+        while (shard.Next(record))
+        {
+            fprintf(out, "%p: %c %p\n", reinterpret_cast<void *>(record.ip),
+                    record.isWrite ? 'W' : 'R', reinterpret_cast<void *>(record.ea));
+        }
+    }
+    if (shard.Error() != 0)
+    {
+        fprintf(stderr, "%s %s\n", argv[1], shard.Error());
+        return 1;
+    }
+
+    fprintf(out, "#eof\n");
+    fclose(out);
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*BEGIN_LEGAL 
+Intel Open Source License 
+
+Copyright (c) 2002-2017 Intel Corporation. All rights reserved.
+ 
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.  Redistributions
+in binary form must reproduce the above copyright notice, this list of
+conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.  Neither the name of
+the Intel Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without
+specific prior written permission.
+ 
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE INTEL OR
+ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+END_LEGAL */
+/*
+ *  Merges the shards of a trace written by pinatrace -binary into one
+ *  text trace in time stamp order, each access preceded by the id of
+ *  its thread.
+ *
+ *  Usage: pinatrace_merge [<trace> [<text trace>]]
+ *  The files default to pinatrace.out and standard output. The trace is
+ *  the index pinatrace writes, listing the shard of every thread.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "pinatrace.H"
+
+static void Print(size_t shard, const PINATRACE::RECORD & record, void * arg)
+{
+    const std::vector<unsigned> & tids = *static_cast<std::vector<unsigned> *>(arg);
+
+    printf("%u %p: %c %p\n", tids[shard], reinterpret_cast<void *>(record.ip),
+           record.isWrite ? 'W' : 'R', reinterpret_cast<void *>(record.ea));
+}
+
+int main(int argc, char * argv[])
+{
+    const char * indexName = (argc > 1 ? argv[1] : "pinatrace.out");
+    FILE * index = fopen(indexName, "r");
+
+    if (index == NULL || (argc > 2 && freopen(argv[2], "w", stdout) == NULL))
+    {
+        fprintf(stderr, "cannot open %s\n", index == NULL ? indexName : argv[2]);
+        return 1;
+    }
+
+    char line[4096];
+    if (fgets(line, sizeof(line), index) == NULL || strcmp(line, "#pinatrace shards\n") != 0)
+    {
+        fprintf(stderr, "%s is not a pinatrace trace\n", indexName);
+        return 1;
+    }
+
+    std::vector<PINATRACE::SHARD_READER *> shards;
+    std::vector<unsigned> tids;
+    std::vector<std::string> names;
+
+    while (fgets(line, sizeof(line), index) != NULL)
+    {
+        unsigned tid;
+        char name[sizeof(line)];
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%u %[^\n]", &tid, name) != 2)
+        {
+            fprintf(stderr, "%s has a corrupt line: %s\n", indexName, line);
+            return 1;
+        }
+
+        shards.push_back(new PINATRACE::SHARD_READER);
+        tids.push_back(tid);
+        names.push_back(name);
+        shards.back()->Open(name);
+    }
+    fclose(index);
+
+    PINATRACE::Merge(shards, Print, &tids);
+
+    int status = 0;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (shards[i]->Error() != 0)
+        {
+            fprintf(stderr, "%s %s\n", names[i].c_str(), shards[i]->Error());
+            status = 1;
+        }
+        delete shards[i];
+    }
+    if (status == 0) printf("#eof\n");
+    fclose(stdout);
+
+    return status;
+}
@@ -0,0 +1,70 @@
+/*BEGIN_LEGAL 
+Intel Open Source License 
+
+Copyright (c) 2002-2017 Intel Corporation. All rights reserved.
+ 
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.  Redistributions
+in binary form must reproduce the above copyright notice, this list of
+conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.  Neither the name of
+the Intel Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without
+specific prior written permission.
+ 
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE INTEL OR
+ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+END_LEGAL */
+/*
+ *  Starts its threads one after another, each one after the previous one
+ *  has exited, so that a tool sees thread ids used again.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+const int NUM_THREADS = 4;
+
+volatile int data[NUM_THREADS];
+
+void * Work(void * arg)
+{
+    const long n = reinterpret_cast<long>(arg);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        data[n] += i;
+    }
+    return 0;
+}
+
+int main()
+{
+    for (long n = 0; n < NUM_THREADS; n++)
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, 0, Work, reinterpret_cast<void *>(n)) != 0)
+        {
+            fprintf(stderr, "cannot create thread %ld\n", n);
+            return 1;
+        }
+        pthread_join(thread, 0);
+    }
+    printf("%d threads done\n", NUM_THREADS);
+
+    return 0;
+}
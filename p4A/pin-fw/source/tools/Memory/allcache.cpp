@@ -31,170 +31,894 @@ END_LEGAL */
 /*! @file
  *  This file contains an ISA-portable PIN tool for functional simulation of
  *  instruction+data TLB+cache hierarchies
+ *
+ *  Every application thread owns its TLBs, L1 and L2 caches; the L3 cache
+ *  is shared by all threads and split into independently locked shards.
+ *  The geometry of each level is read at startup from the knobs below or
+ *  from a config file, so what-if runs do not need a rebuild.
+ *
+ *  With -mrc the hierarchy is not simulated; instead the reuse distances
+ *  of the data accesses of all threads give the miss ratio of a fully
+ *  associative LRU cache of every size in one run.
+ *
+ *  With -attribute the tool also follows malloc, calloc, realloc and free,
+ *  and charges each data cache miss to the allocation site of the heap
+ *  block that missed, reporting the sites that miss most.
  */
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
 
 #include "pin.H"
+#include "atomic.hpp"
 
-typedef UINT32 CACHE_STATS; // type of cache hit/miss counters
+#include "cache.H"
+#include "reuse.H"
+#include "alloc_map.H"
 
-#include "pin_cache.H"
+/* ===================================================================== */
+/* Commandline Switches */
+/* ===================================================================== */
 
-namespace ITLB
+KNOB<string> KnobConfigFile(KNOB_MODE_WRITEONCE, "pintool",
+    "config", "", "read '<level> <spec>' and 'inclusive <0|1>' lines from file, overriding the knobs");
+KNOB<string> KnobItlb(KNOB_MODE_WRITEONCE, "pintool",
+    "itlb", "128k:4k:full:rr", "instruction TLB spec");
+KNOB<string> KnobDtlb(KNOB_MODE_WRITEONCE, "pintool",
+    "dtlb", "128k:4k:full:rr", "data TLB spec");
+KNOB<string> KnobIl1(KNOB_MODE_WRITEONCE, "pintool",
+    "il1", "32k:32:32:rr:noalloc", "1st level instruction cache spec");
+KNOB<string> KnobDl1(KNOB_MODE_WRITEONCE, "pintool",
+    "dl1", "32k:32:32:rr:noalloc", "1st level data cache spec");
+KNOB<string> KnobUl2(KNOB_MODE_WRITEONCE, "pintool",
+    "ul2", "2m:64:1:lru", "2nd level unified cache spec, private to each thread");
+KNOB<string> KnobUl3(KNOB_MODE_WRITEONCE, "pintool",
+    "ul3", "16m:64:1:lru", "3rd level unified cache spec, shared by all threads");
+KNOB<BOOL> KnobInclusive(KNOB_MODE_WRITEONCE, "pintool",
+    "inclusive", "0", "the L2 cache back-invalidates the L1 lines it evicts");
+KNOB<BOOL> KnobSetStats(KNOB_MODE_WRITEONCE, "pintool",
+    "set_stats", "0", "count misses per cache set and report them as a heat map");
+KNOB<BOOL> KnobMrc(KNOB_MODE_WRITEONCE, "pintool",
+    "mrc", "0", "write a miss ratio curve of the data accesses instead of simulating the hierarchy");
+KNOB<string> KnobMrcFile(KNOB_MODE_WRITEONCE, "pintool",
+    "mrc_file", "allcache.mrc", "miss ratio curve file name");
+KNOB<UINT32> KnobMrcLineSize(KNOB_MODE_WRITEONCE, "pintool",
+    "mrc_line", "64", "line size in bytes of the miss ratio curve");
+KNOB<UINT32> KnobMrcSample(KNOB_MODE_WRITEONCE, "pintool",
+    "mrc_sample", "1", "measure one line in n, more lines are dropped past -mrc_lines");
+KNOB<UINT32> KnobMrcLines(KNOB_MODE_WRITEONCE, "pintool",
+    "mrc_lines", "262144", "most lines measured at once, bounding memory use");
+KNOB<BOOL> KnobAttribute(KNOB_MODE_WRITEONCE, "pintool",
+    "attribute", "0", "charge data cache misses to the heap allocation sites of the data");
+KNOB<string> KnobAttributeFile(KNOB_MODE_WRITEONCE, "pintool",
+    "attribute_file", "allcache.sites", "allocation site report file name");
+KNOB<UINT32> KnobAttributeDepth(KNOB_MODE_WRITEONCE, "pintool",
+    "attribute_depth", "1", "call stack frames that make up an allocation site; above 1 calls and returns are tracked");
+KNOB<UINT32> KnobAttributeTop(KNOB_MODE_WRITEONCE, "pintool",
+    "attribute_top", "20", "number of allocation sites reported");
+
+/* ===================================================================== */
+
+INT32 Usage()
+{
+    cerr <<
+        "This tool simulates a TLB and cache hierarchy.\n"
+        "\n"
+        "Each level is given as size:line:associativity:policy[:noalloc]\n"
+        "or as 'none' to leave the level out (the L1 caches are required).\n"
+        "Sizes take a k, m or g suffix, associativity may be 'full' and\n"
+        "the policy is one of rr, lru or plru. Stores allocate on a miss\n"
+        "unless noalloc is given.\n"
+        "\n";
+
+    cerr << KNOB_BASE::StringKnobSummary();
+
+    cerr << endl;
+
+    return -1;
+}
+
+/* ===================================================================== */
+/* Cache configuration */
+/* ===================================================================== */
+
+typedef enum
+{
+    POLICY_ROUND_ROBIN,
+    POLICY_LRU,
+    POLICY_TREE_PLRU
+} POLICY;
+
+/*!
+ *  @brief Geometry of one cache level
+ */
+struct CACHE_SPEC
+{
+    BOOL present;
+    UINT32 cacheSize;
+    UINT32 lineSize;
+    UINT32 associativity;
+    POLICY policy;
+    CACHE_ALLOC::STORE_ALLOCATION allocation;
+};
+
+typedef enum
+{
+    LEVEL_ITLB,
+    LEVEL_DTLB,
+    LEVEL_IL1,
+    LEVEL_DL1,
+    LEVEL_UL2,
+    LEVEL_UL3,
+    LEVEL_NUM
+} LEVEL_ID;
+
+LOCALVAR const struct
+{
+    const char * key;
+    const char * name;
+    KNOB<string> * knob;
+} levelInfo[LEVEL_NUM] =
+{
+    { "itlb", "ITLB", &KnobItlb },
+    { "dtlb", "DTLB", &KnobDtlb },
+    { "il1", "L1 Instruction Cache", &KnobIl1 },
+    { "dl1", "L1 Data Cache", &KnobDl1 },
+    { "ul2", "L2 Unified Cache", &KnobUl2 },
+    { "ul3", "L3 Unified Cache", &KnobUl3 }
+};
+
+LOCALVAR CACHE_SPEC specs[LEVEL_NUM];
+LOCALVAR BOOL inclusive = false;
+
+/*!
+ *  @brief Parses a size with an optional k, m or g suffix
+ *  @return false if text is not a size
+ */
+LOCALFUN BOOL ParseSize(const string & text, UINT32 & size)
+{
+    char * end;
+    UINT64 value = strtoul(text.c_str(), &end, 10);
+
+    if (end == text.c_str()) return false;
+
+    switch (*end)
+    {
+      case 'k': case 'K': value *= KILO; end++; break;
+      case 'm': case 'M': value *= MEGA; end++; break;
+      case 'g': case 'G': value *= GIGA; end++; break;
+      default: break;
+    }
+    if (*end != '\0' || value == 0 || value > 0xffffffffULL) return false;
+
+    size = UINT32(value);
+    return true;
+}
+
+/*!
+ *  @brief Parses a size:line:associativity:policy[:noalloc] level spec
+ *  @return empty string on success, otherwise what is wrong with text
+ */
+LOCALFUN string ParseSpec(const string & text, CACHE_SPEC & spec)
+{
+    spec.present = (text != "none");
+    if (! spec.present) return "";
+
+    std::vector<string> fields;
+    std::istringstream in(text);
+    string field;
+    while (std::getline(in, field, ':')) fields.push_back(field);
+
+    if (fields.size() < 4 || fields.size() > 5)
+        return "expected size:line:associativity:policy[:noalloc]";
+
+    if (! ParseSize(fields[0], spec.cacheSize)) return "bad size " + fields[0];
+    if (! ParseSize(fields[1], spec.lineSize)) return "bad line size " + fields[1];
+    if (! IsPower2(spec.lineSize) || spec.lineSize > spec.cacheSize)
+        return "line size must be a power of 2 no larger than the cache";
+
+    if (fields[2] == "full") spec.associativity = spec.cacheSize / spec.lineSize;
+    else if (! ParseSize(fields[2], spec.associativity)) return "bad associativity " + fields[2];
+
+    if (fields[3] == "rr") spec.policy = POLICY_ROUND_ROBIN;
+    else if (fields[3] == "lru") spec.policy = POLICY_LRU;
+    else if (fields[3] == "plru") spec.policy = POLICY_TREE_PLRU;
+    else return "unknown policy " + fields[3];
+
+    spec.allocation = CACHE_ALLOC::STORE_ALLOCATE;
+    if (fields.size() == 5)
+    {
+        if (fields[4] != "noalloc") return "unknown option " + fields[4];
+        spec.allocation = CACHE_ALLOC::STORE_NO_ALLOCATE;
+    }
+
+    if (spec.associativity > 256) return "at most 256 ways are supported";
+    if (spec.cacheSize % (spec.lineSize * spec.associativity) != 0
+        || ! IsPower2(spec.cacheSize / (spec.lineSize * spec.associativity)))
+        return "size / (line size * associativity) must be a power of 2";
+    if (spec.policy == POLICY_TREE_PLRU && ! IsPower2(spec.associativity))
+        return "plru needs a power of 2 associativity";
+
+    return "";
+}
+
+/*!
+ *  @brief Reads the level specs from the knobs, then from the config file
+ *  @return false after printing an error
+ */
+LOCALFUN BOOL Configure()
+{
+    string text[LEVEL_NUM];
+
+    for (UINT32 level = 0; level < LEVEL_NUM; level++)
+    {
+        text[level] = levelInfo[level].knob->Value();
+    }
+    inclusive = KnobInclusive.Value();
+
+    if (! KnobConfigFile.Value().empty())
+    {
+        std::ifstream config(KnobConfigFile.Value().c_str());
+        if (! config)
+        {
+            cerr << "cannot open " << KnobConfigFile.Value() << endl;
+            return false;
+        }
+
+        string line;
+        for (UINT32 lineNumber = 1; std::getline(config, line); lineNumber++)
+        {
+            std::istringstream in(line);
+            string key, value;
+
+            if (! (in >> key) || key[0] == '#') continue;
+            in >> value;
+
+            UINT32 level = 0;
+            while (level < LEVEL_NUM && key != levelInfo[level].key) level++;
+
+            if (level < LEVEL_NUM) text[level] = value;
+            else if (key == "inclusive") inclusive = (value == "1");
+            else
+            {
+                cerr << KnobConfigFile.Value() << ":" << lineNumber << ": unknown level " << key << endl;
+                return false;
+            }
+        }
+    }
+
+    for (UINT32 level = 0; level < LEVEL_NUM; level++)
+    {
+        const string error = ParseSpec(text[level], specs[level]);
+        if (! error.empty())
+        {
+            cerr << levelInfo[level].key << " " << text[level] << ": " << error << endl;
+            return false;
+        }
+    }
+    if (! specs[LEVEL_IL1].present || ! specs[LEVEL_DL1].present)
+    {
+        cerr << "the L1 caches cannot be left out" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/* ===================================================================== */
+/* Miss attribution */
+/* ===================================================================== */
+
+#if defined(TARGET_MAC)
+#define MALLOC "_malloc"
+#define CALLOC "_calloc"
+#define REALLOC "_realloc"
+#define FREE "_free"
+#else
+#define MALLOC "malloc"
+#define CALLOC "calloc"
+#define REALLOC "realloc"
+#define FREE "free"
+#endif
+
+// live heap blocks and their sites, 0 unless -attribute
+LOCALVAR ALLOCATION_MAP * allocations = 0;
+LOCALVAR PIN_RWMUTEX allocationsMutex;
+
+/*!
+ *  @brief Allocator call in progress and call stack of one thread
+ */
+class THREAD_ALLOC
+{
+  public:
+    std::vector<ADDRINT> callStack; // return addresses, innermost last
+    UINT32 depth;                   // allocator calls entered and not returned
+    ADDRINT size;                   // requested by the outermost one
+    ADDRINT oldAddr;                // block it reallocates, or 0
+    std::vector<ADDRINT> site;      // stack it was called from
+
+    THREAD_ALLOC() : depth(0), size(0), oldAddr(0) {}
+};
+
+LOCALVAR TLS_KEY allocKey = INVALID_TLS_KEY;
+
+LOCALFUN THREAD_ALLOC * GetAlloc(THREADID tid)
+{
+    return static_cast<THREAD_ALLOC *>(PIN_GetThreadData(allocKey, tid));
+}
+
+LOCALFUN VOID CallPush(ADDRINT returnAddr, THREADID tid)
+{
+    GetAlloc(tid)->callStack.push_back(returnAddr);
+}
+
+LOCALFUN VOID RetPop(ADDRINT target, THREADID tid)
+{
+    std::vector<ADDRINT> & stack = GetAlloc(tid)->callStack;
+
+    // longjmp and exceptions skip frames; look a few deep for the target
+    for (UINT32 i = stack.size(); i-- > 0 && stack.size() - i <= 8; )
+    {
+        if (stack[i] == target)
+        {
+            stack.resize(i);
+            return;
+        }
+    }
+}
+
+LOCALFUN VOID AllocBefore(ADDRINT size, ADDRINT oldAddr, ADDRINT returnIp, THREADID tid)
+{
+    THREAD_ALLOC * alloc = GetAlloc(tid);
+
+    // allocator functions calling each other are one allocation
+    if (alloc->depth++ != 0) return;
+
+    alloc->size = size;
+    alloc->oldAddr = oldAddr;
+    alloc->site.assign(1, returnIp);
+
+    // with calls tracked, the top of the stack is returnIp itself
+    const std::vector<ADDRINT> & stack = alloc->callStack;
+    UINT32 i = stack.size();
+    if (i > 0 && stack[i - 1] == returnIp) i--;
+    while (i-- > 0 && alloc->site.size() < KnobAttributeDepth.Value())
+    {
+        alloc->site.push_back(stack[i]);
+    }
+}
+
+LOCALFUN VOID MallocBefore(ADDRINT size, ADDRINT returnIp, THREADID tid)
+{
+    AllocBefore(size, 0, returnIp, tid);
+}
+
+LOCALFUN VOID CallocBefore(ADDRINT count, ADDRINT size, ADDRINT returnIp, THREADID tid)
+{
+    AllocBefore(count * size, 0, returnIp, tid);
+}
+
+LOCALFUN VOID ReallocBefore(ADDRINT oldAddr, ADDRINT size, ADDRINT returnIp, THREADID tid)
+{
+    AllocBefore(size, oldAddr, returnIp, tid);
+}
+
+LOCALFUN VOID AllocAfter(ADDRINT addr, THREADID tid)
+{
+    THREAD_ALLOC * alloc = GetAlloc(tid);
+
+    if (alloc->depth == 0 || --alloc->depth != 0) return;
+
+    PIN_RWMutexWriteLock(&allocationsMutex);
+    // a failed realloc keeps the old block
+    if (alloc->oldAddr && (addr || alloc->size == 0)) allocations->Free(alloc->oldAddr);
+    if (addr) allocations->Allocate(addr, alloc->size, allocations->Site(alloc->site));
+    PIN_RWMutexUnlock(&allocationsMutex);
+}
+
+LOCALFUN VOID FreeBefore(ADDRINT addr)
+{
+    PIN_RWMutexWriteLock(&allocationsMutex);
+    allocations->Free(addr);
+    PIN_RWMutexUnlock(&allocationsMutex);
+}
+
+/// charges a data access that missed the first missed levels
+LOCALFUN VOID Attribute(ADDRINT addr, UINT32 missed)
+{
+    PIN_RWMutexReadLock(&allocationsMutex);
+    ALLOCATION_MAP::SITE * site = allocations->Find(addr);
+    PIN_RWMutexUnlock(&allocationsMutex);
+
+    for (UINT32 level = 0; level < missed; level++)
+    {
+        ATOMIC::OPS::Increment<UINT64>(&site->misses[level], 1);
+    }
+}
+
+LOCALFUN VOID InstrumentAllocator(IMG img, const char * name, AFUNPTR before, UINT32 numArgs)
+{
+    RTN rtn = RTN_FindByName(img, name);
+    if (! RTN_Valid(rtn)) return;
+
+    RTN_Open(rtn);
+    if (numArgs == 1)
+    {
+        RTN_InsertCall(rtn, IPOINT_BEFORE, before,
+                       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                       IARG_RETURN_IP,
+                       IARG_THREAD_ID,
+                       IARG_END);
+    }
+    else
+    {
+        RTN_InsertCall(rtn, IPOINT_BEFORE, before,
+                       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                       IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+                       IARG_RETURN_IP,
+                       IARG_THREAD_ID,
+                       IARG_END);
+    }
+    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)AllocAfter,
+                   IARG_FUNCRET_EXITPOINT_VALUE,
+                   IARG_THREAD_ID,
+                   IARG_END);
+    RTN_Close(rtn);
+}
+
+LOCALFUN VOID Image(IMG img, VOID *v)
+{
+    InstrumentAllocator(img, MALLOC, (AFUNPTR)MallocBefore, 1);
+    InstrumentAllocator(img, CALLOC, (AFUNPTR)CallocBefore, 2);
+    InstrumentAllocator(img, REALLOC, (AFUNPTR)ReallocBefore, 2);
+
+    RTN freeRtn = RTN_FindByName(img, FREE);
+    if (RTN_Valid(freeRtn))
+    {
+        RTN_Open(freeRtn);
+        RTN_InsertCall(freeRtn, IPOINT_BEFORE, (AFUNPTR)FreeBefore,
+                       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                       IARG_END);
+        RTN_Close(freeRtn);
+    }
+}
+
+/// shadow call stack for allocation sites deeper than the caller
+LOCALFUN VOID InstructionCalls(INS ins, VOID *v)
+{
+    if (INS_IsCall(ins))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)CallPush,
+            IARG_ADDRINT, INS_NextAddress(ins),
+            IARG_THREAD_ID,
+            IARG_END);
+    }
+    else if (INS_IsRet(ins))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR)RetPop,
+            IARG_BRANCH_TARGET_ADDR,
+            IARG_THREAD_ID,
+            IARG_END);
+    }
+}
+
+LOCALFUN string Symbolize(ADDRINT addr)
+{
+    const string name = RTN_FindNameByAddress(addr);
+    INT32 line = 0;
+    string file;
+
+    PIN_GetSourceLocation(addr, NULL, &line, &file);
+
+    string text = hexstr(addr) + " " + (name.empty() ? "?" : name);
+    if (! file.empty()) text += " (" + file + ":" + decstr(line) + ")";
+    return text;
+}
+
+LOCALFUN VOID AttributeFini()
 {
-    // instruction TLB: 4 kB pages, 32 entries, fully associative
-    const UINT32 lineSize = 4*KILO;
-    const UINT32 cacheSize = 32 * lineSize;
-    const UINT32 associativity = 32;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+    const char * names[ALLOCATION_MAP::MAX_LEVELS];
+    UINT32 numLevels = 0;
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = associativity;
+    names[numLevels++] = "L1 data";
+    if (specs[LEVEL_UL2].present) names[numLevels++] = "L2";
+    if (specs[LEVEL_UL3].present) names[numLevels++] = "L3";
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+    std::ofstream out(KnobAttributeFile.Value().c_str());
+
+    PIN_LockClient();
+    allocations->Report(out, KnobAttributeTop.Value(), numLevels, names, numLevels - 1, Symbolize);
+    PIN_UnlockClient();
 }
-LOCALFUN ITLB::CACHE itlb("ITLB", ITLB::cacheSize, ITLB::lineSize, ITLB::associativity);
 
-namespace DTLB
+/* ===================================================================== */
+/* Cache levels */
+/* ===================================================================== */
+
+/*!
+ *  @brief One level of the hierarchy, whatever its geometry
+ */
+class CACHE_LEVEL
+{
+  public:
+    virtual ~CACHE_LEVEL() {}
+
+    virtual bool Access(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType) = 0;
+    virtual bool AccessSingleLine(ADDRINT addr, CACHE_BASE::ACCESS_TYPE accessType) = 0;
+    virtual VOID Invalidate(ADDRINT addr) = 0;
+    virtual CACHE_BASE & Base() = 0;
+};
+
+template <class CACHE_T>
+class LEVEL : public CACHE_LEVEL
 {
-    // data TLB: 4 kB pages, 32 entries, fully associative
-    const UINT32 lineSize = 4*KILO;
-    const UINT32 cacheSize = 32 * lineSize;
-    const UINT32 associativity = 32;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+  private:
+    CACHE_T _cache;
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = associativity;
+  public:
+    LEVEL(const string & name, const CACHE_SPEC & spec)
+      : _cache(name, spec.cacheSize, spec.lineSize, spec.associativity)
+    {}
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+    bool Access(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+    {
+        return _cache.Access(addr, size, accessType);
+    }
+    bool AccessSingleLine(ADDRINT addr, CACHE_BASE::ACCESS_TYPE accessType)
+    {
+        return _cache.AccessSingleLine(addr, accessType);
+    }
+    VOID Invalidate(ADDRINT addr) { _cache.Invalidate(addr); }
+    CACHE_BASE & Base() { return _cache; }
+};
+
+/*!
+ *  @brief Cache with sets sized at run time and the smallest way array
+ *  that holds the requested associativity
+ */
+template <template <UINT32> class SET, UINT32 ALLOCATION>
+LOCALFUN CACHE_LEVEL * NewSizedLevel(const string & name, const CACHE_SPEC & spec)
+{
+    if (spec.associativity <= 4) return new LEVEL<CACHE<SET<4>, 0, ALLOCATION> >(name, spec);
+    if (spec.associativity <= 8) return new LEVEL<CACHE<SET<8>, 0, ALLOCATION> >(name, spec);
+    if (spec.associativity <= 16) return new LEVEL<CACHE<SET<16>, 0, ALLOCATION> >(name, spec);
+    if (spec.associativity <= 32) return new LEVEL<CACHE<SET<32>, 0, ALLOCATION> >(name, spec);
+    if (spec.associativity <= 64) return new LEVEL<CACHE<SET<64>, 0, ALLOCATION> >(name, spec);
+    return new LEVEL<CACHE<SET<256>, 0, ALLOCATION> >(name, spec);
 }
-LOCALVAR DTLB::CACHE dtlb("DTLB", DTLB::cacheSize, DTLB::lineSize, DTLB::associativity);
 
-namespace IL1
+// a constant-specialized cache for one common geometry
+#define COMMON_LEVEL(POLICY, SET, SETS, ASSOCIATIVITY) \
+    if (spec.policy == POLICY && sets == SETS && spec.associativity == ASSOCIATIVITY) \
+        return new LEVEL<CACHE<SET<ASSOCIATIVITY>, SETS, ALLOCATION> >(name, spec)
+
+#define COMMON_DIRECT_MAPPED(SETS) \
+    if (spec.associativity == 1 && sets == SETS) \
+        return new LEVEL<CACHE_DIRECT_MAPPED(SETS, ALLOCATION)>(name, spec)
+
+template <UINT32 ALLOCATION>
+LOCALFUN CACHE_LEVEL * NewLevel(const string & name, const CACHE_SPEC & spec)
 {
-    // 1st level instruction cache: 32 kB, 32 B lines, 32-way associative
-    const UINT32 cacheSize = 32*KILO;
-    const UINT32 lineSize = 32;
-    const UINT32 associativity = 32;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_NO_ALLOCATE;
+    const UINT32 sets = spec.cacheSize / (spec.lineSize * spec.associativity);
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = associativity;
+    // the default hierarchy and typical current parts
+    COMMON_DIRECT_MAPPED(2*MEGA / 64);
+    COMMON_DIRECT_MAPPED(16*MEGA / 64);
+    COMMON_LEVEL(POLICY_ROUND_ROBIN, CACHE_SET::ROUND_ROBIN, 1, 32);
+    COMMON_LEVEL(POLICY_ROUND_ROBIN, CACHE_SET::ROUND_ROBIN, 32, 32);
+    COMMON_LEVEL(POLICY_LRU, CACHE_SET::LRU, 16, 4);
+    COMMON_LEVEL(POLICY_TREE_PLRU, CACHE_SET::TREE_PLRU, 64, 8);
+    COMMON_LEVEL(POLICY_LRU, CACHE_SET::LRU, 1024, 16);
+    COMMON_LEVEL(POLICY_LRU, CACHE_SET::LRU, 256, 16);
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+    if (spec.associativity == 1) return new LEVEL<CACHE_DIRECT_MAPPED(0, ALLOCATION)>(name, spec);
+
+    switch (spec.policy)
+    {
+      case POLICY_ROUND_ROBIN: return NewSizedLevel<CACHE_SET::ROUND_ROBIN, ALLOCATION>(name, spec);
+      case POLICY_LRU: return NewSizedLevel<CACHE_SET::LRU, ALLOCATION>(name, spec);
+      default: return NewSizedLevel<CACHE_SET::TREE_PLRU, ALLOCATION>(name, spec);
+    }
 }
-LOCALVAR IL1::CACHE il1("L1 Instruction Cache", IL1::cacheSize, IL1::lineSize, IL1::associativity);
 
-namespace DL1
+LOCALFUN CACHE_LEVEL * NewLevel(const string & name, const CACHE_SPEC & spec)
 {
-    // 1st level data cache: 32 kB, 32 B lines, 32-way associative
-    const UINT32 cacheSize = 32*KILO;
-    const UINT32 lineSize = 32;
-    const UINT32 associativity = 32;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_NO_ALLOCATE;
+    if (! spec.present) return 0;
+
+    CACHE_LEVEL * level = (spec.allocation == CACHE_ALLOC::STORE_ALLOCATE
+                           ? NewLevel<CACHE_ALLOC::STORE_ALLOCATE>(name, spec)
+                           : NewLevel<CACHE_ALLOC::STORE_NO_ALLOCATE>(name, spec));
+    if (KnobSetStats) level->Base().EnableSetStats();
+    return level;
+}
+
+/*!
+ *  @brief Cache shared by all threads
+ *
+ *  The sets are split into up to MAX_SHARDS groups by the top bits of the
+ *  set index, each group being a cache of its own behind its own lock. A
+ *  line maps to the same set it would in the unsharded cache, so the
+ *  simulated contents do not depend on the number of shards.
+ */
+class SHARED_CACHE : public CACHE_BASE
+{
+  private:
+    static const UINT32 MAX_SHARDS = 64;
+
+    // keep each lock on its own host cache line
+    struct STRIPE
+    {
+        PIN_LOCK _lock;
+        CACHE_LEVEL * _cache;
+        UINT8 _pad[64 - (sizeof(PIN_LOCK) + sizeof(CACHE_LEVEL *)) % 64];
+    };
+
+    STRIPE _stripes[MAX_SHARDS];
+    UINT32 _shardMask;
+    UINT32 _shardShift;
+
+  public:
+    SHARED_CACHE(const string & name, const CACHE_SPEC & spec)
+      : CACHE_BASE(name, spec.cacheSize, spec.lineSize, spec.associativity)
+    {
+        const UINT32 shards = (NumSets() < MAX_SHARDS ? NumSets() : MAX_SHARDS);
+        CACHE_SPEC shardSpec = spec;
+
+        shardSpec.cacheSize /= shards;
+        _shardMask = shards - 1;
+        _shardShift = FloorLog2(spec.lineSize) + FloorLog2(NumSets() / shards);
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = associativity;
+        for (UINT32 i = 0; i < shards; i++)
+        {
+            PIN_InitLock(&_stripes[i]._lock);
+            _stripes[i]._cache = NewLevel(name, shardSpec);
+        }
+
+        // the shards count their own sets too; these counts are kept by
+        // global set index, a set being only ever touched under its shard lock
+        if (KnobSetStats) EnableSetStats();
+    }
+
+    /// Cache access from addr to addr+size-1 on behalf of thread tid
+    bool Access(ADDRINT addr, UINT32 size, ACCESS_TYPE accessType, THREADID tid)
+    {
+        const ADDRINT highAddr = addr + size;
+        bool allHit = true;
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
+        const ADDRINT lineSize = LineSize();
+        const ADDRINT notLineMask = ~(lineSize - 1);
+        do
+        {
+            STRIPE & stripe = _stripes[(addr >> _shardShift) & _shardMask];
+
+            PIN_GetLock(&stripe._lock, tid + 1);
+            const bool hit = stripe._cache->AccessSingleLine(addr, accessType);
+            if (_setStats)
+            {
+                CACHE_TAG tag;
+                UINT32 setIndex;
+                SplitAddress(addr, tag, setIndex);
+                CountSet(setIndex, hit);
+            }
+            PIN_ReleaseLock(&stripe._lock);
+            allHit &= hit;
+
+            addr = (addr & notLineMask) + lineSize; // start of next cache line
+        }
+        while (addr < highAddr);
+
+        ATOMIC::OPS::Increment<CACHE_STATS>(&_access[accessType][allHit], 1);
+
+        return allHit;
+    }
+};
+LOCALVAR SHARED_CACHE * ul3 = 0;
+
+/*!
+ *  @brief Caches private to one application thread, 0 for levels left out
+ */
+class THREAD_CACHES
+{
+  public:
+    CACHE_LEVEL * itlb;
+    CACHE_LEVEL * dtlb;
+    CACHE_LEVEL * il1;
+    CACHE_LEVEL * dl1;
+    CACHE_LEVEL * ul2;
+
+    THREAD_CACHES();
+    ~THREAD_CACHES();
+};
+
+LOCALFUN VOID InvalidateLines(CACHE_LEVEL * cache, ADDRINT addr, ADDRINT highAddr)
+{
+    const ADDRINT lineSize = cache->Base().LineSize();
+
+    for (addr &= ~(lineSize - 1); addr < highAddr; addr += lineSize)
+    {
+        cache->Invalidate(addr);
+    }
 }
-LOCALVAR DL1::CACHE dl1("L1 Data Cache", DL1::cacheSize, DL1::lineSize, DL1::associativity);
 
-namespace UL2
+/// keeps the L1 caches a subset of an inclusive L2
+LOCALFUN VOID Ul2Evicted(ADDRINT lineAddr, VOID * v)
 {
-    // 2nd level unified cache: 2 MB, 64 B lines, direct mapped
-    const UINT32 cacheSize = 2*MEGA;
-    const UINT32 lineSize = 64;
-    const UINT32 associativity = 1;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+    THREAD_CACHES * caches = static_cast<THREAD_CACHES *>(v);
+    const ADDRINT highAddr = lineAddr + caches->ul2->Base().LineSize();
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
+    InvalidateLines(caches->il1, lineAddr, highAddr);
+    InvalidateLines(caches->dl1, lineAddr, highAddr);
+}
 
-    typedef CACHE_DIRECT_MAPPED(max_sets, allocation) CACHE;
+THREAD_CACHES::THREAD_CACHES()
+  : itlb(NewLevel(levelInfo[LEVEL_ITLB].name, specs[LEVEL_ITLB])),
+    dtlb(NewLevel(levelInfo[LEVEL_DTLB].name, specs[LEVEL_DTLB])),
+    il1(NewLevel(levelInfo[LEVEL_IL1].name, specs[LEVEL_IL1])),
+    dl1(NewLevel(levelInfo[LEVEL_DL1].name, specs[LEVEL_DL1])),
+    ul2(NewLevel(levelInfo[LEVEL_UL2].name, specs[LEVEL_UL2]))
+{
+    if (ul2 && inclusive) ul2->Base().SetEvictCallback(Ul2Evicted, this);
 }
-LOCALVAR UL2::CACHE ul2("L2 Unified Cache", UL2::cacheSize, UL2::lineSize, UL2::associativity);
 
-namespace UL3
+THREAD_CACHES::~THREAD_CACHES()
 {
-    // 3rd level unified cache: 16 MB, 64 B lines, direct mapped
-    const UINT32 cacheSize = 16*MEGA;
-    const UINT32 lineSize = 64;
-    const UINT32 associativity = 1;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+    delete itlb;
+    delete dtlb;
+    delete il1;
+    delete dl1;
+    delete ul2;
+}
+
+// key for the THREAD_CACHES of each thread, initialized once in main()
+LOCALVAR TLS_KEY tlsKey = INVALID_TLS_KEY;
 
-    const UINT32 max_sets = cacheSize / (lineSize * associativity);
+// serializes the per-thread reports
+LOCALVAR PIN_LOCK outputLock;
 
-    typedef CACHE_DIRECT_MAPPED(max_sets, allocation) CACHE;
+LOCALFUN THREAD_CACHES * GetCaches(THREADID tid)
+{
+    return static_cast<THREAD_CACHES *>(PIN_GetThreadData(tlsKey, tid));
+}
+
+LOCALFUN VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    PIN_SetThreadData(tlsKey, new THREAD_CACHES, tid);
+    if (allocations) PIN_SetThreadData(allocKey, new THREAD_ALLOC, tid);
+}
+
+LOCALFUN VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    THREAD_CACHES * caches = GetCaches(tid);
+
+    PIN_GetLock(&outputLock, tid + 1);
+    std::cerr << "Thread " << tid << ":" << std::endl;
+    if (caches->itlb) std::cerr << caches->itlb->Base();
+    if (caches->dtlb) std::cerr << caches->dtlb->Base();
+    std::cerr << caches->il1->Base();
+    std::cerr << caches->dl1->Base();
+    if (caches->ul2) std::cerr << caches->ul2->Base();
+    PIN_ReleaseLock(&outputLock);
+
+    delete caches;
+    PIN_SetThreadData(tlsKey, NULL, tid);
+
+    if (allocations)
+    {
+        delete GetAlloc(tid);
+        PIN_SetThreadData(allocKey, NULL, tid);
+    }
 }
-LOCALVAR UL3::CACHE ul3("L3 Unified Cache", UL3::cacheSize, UL3::lineSize, UL3::associativity);
 
 LOCALFUN VOID Fini(int code, VOID * v)
 {
-    std::cerr << itlb;
-    std::cerr << dtlb;
-    std::cerr << il1;
-    std::cerr << dl1;
-    std::cerr << ul2;
-    std::cerr << ul3;
+    if (ul3) std::cerr << *ul3;
+    if (allocations) AttributeFini();
 }
 
-LOCALFUN VOID Ul2Access(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+/// @return how many of the L2 and L3 caches present missed
+LOCALFUN UINT32 Ul2Access(THREAD_CACHES * caches, ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType, THREADID tid)
 {
+    UINT32 missed = 0;
+
     // second level unified cache
-    const BOOL ul2Hit = ul2.Access(addr, size, accessType);
+    if (caches->ul2)
+    {
+        if (caches->ul2->Access(addr, size, accessType)) return missed;
+        missed++;
+    }
 
     // third level unified cache
-    if ( ! ul2Hit) ul3.Access(addr, size, accessType);
+    if (ul3 && ! ul3->Access(addr, size, accessType, tid)) missed++;
+
+    return missed;
 }
 
-LOCALFUN VOID InsRef(ADDRINT addr)
+/// fetch of the basic block from addr to addr+size-1
+LOCALFUN VOID BlockRef(ADDRINT addr, UINT32 size, THREADID tid)
 {
-    const UINT32 size = 1; // assuming access does not cross cache lines
     const CACHE_BASE::ACCESS_TYPE accessType = CACHE_BASE::ACCESS_TYPE_LOAD;
+    const ADDRINT highAddr = addr + size;
+    THREAD_CACHES * caches = GetCaches(tid);
 
-    // ITLB
-    itlb.AccessSingleLine(addr, accessType);
+    // ITLB, once per page the block spans
+    if (caches->itlb)
+    {
+        const ADDRINT pageSize = caches->itlb->Base().LineSize();
 
-    // first level I-cache
-    const BOOL il1Hit = il1.AccessSingleLine(addr, accessType);
+        for (ADDRINT page = addr & ~(pageSize - 1); page < highAddr; page += pageSize)
+        {
+            caches->itlb->AccessSingleLine(page, accessType);
+        }
+    }
 
-    // second level unified Cache
-    if ( ! il1Hit) Ul2Access(addr, size, accessType);
+    // first level I-cache, once per line
+    const ADDRINT lineSize = caches->il1->Base().LineSize();
+
+    for (ADDRINT line = addr & ~(lineSize - 1); line < highAddr; line += lineSize)
+    {
+        const BOOL il1Hit = caches->il1->AccessSingleLine(line, accessType);
+
+        // second level unified Cache
+        if ( ! il1Hit) Ul2Access(caches, line, lineSize, accessType, tid);
+    }
 }
 
-LOCALFUN VOID MemRefMulti(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+
+LOCALFUN VOID MemRefMulti(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType, THREADID tid)
 {
+    THREAD_CACHES * caches = GetCaches(tid);
+
     // DTLB
-    dtlb.AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+    if (caches->dtlb) caches->dtlb->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     // first level D-cache
-    const BOOL dl1Hit = dl1.Access(addr, size, accessType);
+    const BOOL dl1Hit = caches->dl1->Access(addr, size, accessType);
 
     // second level unified Cache
-    if ( ! dl1Hit) Ul2Access(addr, size, accessType);
+    if ( ! dl1Hit)
+    {
+        const UINT32 missed = 1 + Ul2Access(caches, addr, size, accessType, tid);
+        if (allocations) Attribute(addr, missed);
+    }
 }
 
-LOCALFUN VOID MemRefSingle(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType)
+LOCALFUN VOID MemRefSingle(ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE accessType, THREADID tid)
 {
+    THREAD_CACHES * caches = GetCaches(tid);
+
     // DTLB
-    dtlb.AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+    if (caches->dtlb) caches->dtlb->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     // first level D-cache
-    const BOOL dl1Hit = dl1.AccessSingleLine(addr, accessType);
+    const BOOL dl1Hit = caches->dl1->AccessSingleLine(addr, accessType);
 
     // second level unified Cache
-    if ( ! dl1Hit) Ul2Access(addr, size, accessType);
+    if ( ! dl1Hit)
+    {
+        const UINT32 missed = 1 + Ul2Access(caches, addr, size, accessType, tid);
+        if (allocations) Attribute(addr, missed);
+    }
+}
+LOCALFUN VOID Trace(TRACE trace, VOID *v)
+{
+    // instruction fetches access the I-cache a basic block at a time
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        BBL_InsertCall(
+            bbl, IPOINT_BEFORE, (AFUNPTR)BlockRef,
+            IARG_ADDRINT, BBL_Address(bbl),
+            IARG_UINT32, BBL_Size(bbl),
+            IARG_THREAD_ID,
+            IARG_END);
+    }
 }
 
 LOCALFUN VOID Instruction(INS ins, VOID *v)
 {
-    // all instruction fetches access I-cache
-    INS_InsertCall(
-        ins, IPOINT_BEFORE, (AFUNPTR)InsRef,
-        IARG_INST_PTR,
-        IARG_END);
-
     if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins))
     {
         const UINT32 size = INS_MemoryReadSize(ins);
@@ -206,6 +930,7 @@ LOCALFUN VOID Instruction(INS ins, VOID *v)
             IARG_MEMORYREAD_EA,
             IARG_MEMORYREAD_SIZE,
             IARG_UINT32, CACHE_BASE::ACCESS_TYPE_LOAD,
+            IARG_THREAD_ID,
             IARG_END);
     }
 
@@ -220,14 +945,132 @@ LOCALFUN VOID Instruction(INS ins, VOID *v)
             IARG_MEMORYWRITE_EA,
             IARG_MEMORYWRITE_SIZE,
             IARG_UINT32, CACHE_BASE::ACCESS_TYPE_STORE,
+            IARG_THREAD_ID,
+            IARG_END);
+    }
+}
+
+/* ===================================================================== */
+/* Miss ratio curve */
+/* ===================================================================== */
+
+LOCALVAR REUSE_DISTANCE * reuse = 0;
+LOCALVAR PIN_LOCK reuseLock;
+
+// line accesses of each thread, sampled or not, each on its own host cache line
+LOCALVAR struct
+{
+    UINT64 count;
+    UINT8 pad[64 - sizeof(UINT64)];
+} mrcAccesses[PIN_MAX_THREADS];
+
+LOCALFUN VOID MrcRef(ADDRINT addr, UINT32 size, THREADID tid)
+{
+    const ADDRINT highAddr = addr + size;
+    const ADDRINT lineSize = reuse->LineSize();
+
+    for (addr &= ~(lineSize - 1); addr < highAddr; addr += lineSize)
+    {
+        mrcAccesses[tid].count++;
+
+        // most lines are not sampled, so check before taking the lock
+        if (! reuse->Sampled(addr)) continue;
+
+        PIN_GetLock(&reuseLock, tid + 1);
+        reuse->Access(addr);
+        PIN_ReleaseLock(&reuseLock);
+    }
+}
+
+LOCALFUN VOID InstructionMrc(INS ins, VOID *v)
+{
+    if (INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) MrcRef,
+            IARG_MEMORYREAD_EA,
+            IARG_MEMORYREAD_SIZE,
+            IARG_THREAD_ID,
+            IARG_END);
+    }
+
+    if (INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins))
+    {
+        INS_InsertPredicatedCall(
+            ins, IPOINT_BEFORE, (AFUNPTR) MrcRef,
+            IARG_MEMORYWRITE_EA,
+            IARG_MEMORYWRITE_SIZE,
+            IARG_THREAD_ID,
             IARG_END);
     }
 }
 
+LOCALFUN VOID MrcFini(int code, VOID * v)
+{
+    UINT64 accesses = 0;
+    for (UINT32 tid = 0; tid < PIN_MAX_THREADS; tid++) accesses += mrcAccesses[tid].count;
+
+    std::ofstream out(KnobMrcFile.Value().c_str());
+    reuse->PrintCurve(out, accesses);
+}
+
 GLOBALFUN int main(int argc, char *argv[])
 {
-    PIN_Init(argc, argv);
+    if (PIN_Init(argc, argv) || ! Configure())
+    {
+        return Usage();
+    }
+
+    if (KnobMrc)
+    {
+        if (! IsPower2(KnobMrcLineSize.Value()) || KnobMrcSample.Value() == 0
+            || KnobMrcLines.Value() == 0)
+        {
+            std::cerr << "-mrc_line must be a power of 2, -mrc_sample and -mrc_lines positive" << std::endl;
+            return Usage();
+        }
+        reuse = new REUSE_DISTANCE(KnobMrcLineSize.Value(), KnobMrcSample.Value(), KnobMrcLines.Value());
+        PIN_InitLock(&reuseLock);
+
+        INS_AddInstrumentFunction(InstructionMrc, 0);
+        PIN_AddFiniFunction(MrcFini, 0);
+
+        // Never returns
+        PIN_StartProgram();
+    }
+
+    if (specs[LEVEL_UL3].present)
+    {
+        ul3 = new SHARED_CACHE(levelInfo[LEVEL_UL3].name, specs[LEVEL_UL3]);
+    }
+
+    tlsKey = PIN_CreateThreadDataKey(NULL);
+    if (tlsKey == INVALID_TLS_KEY)
+    {
+        std::cerr << "number of already allocated keys reached the MAX_CLIENT_TLS_KEYS limit" << std::endl;
+        PIN_ExitProcess(1);
+    }
+    PIN_InitLock(&outputLock);
+
+    if (KnobAttribute)
+    {
+        allocKey = PIN_CreateThreadDataKey(NULL);
+        if (allocKey == INVALID_TLS_KEY)
+        {
+            std::cerr << "number of already allocated keys reached the MAX_CLIENT_TLS_KEYS limit" << std::endl;
+            PIN_ExitProcess(1);
+        }
+        PIN_InitSymbols();
+        PIN_RWMutexInit(&allocationsMutex);
+        allocations = new ALLOCATION_MAP;
+
+        IMG_AddInstrumentFunction(Image, 0);
+        if (KnobAttributeDepth.Value() > 1) INS_AddInstrumentFunction(InstructionCalls, 0);
+    }
 
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+    TRACE_AddInstrumentFunction(Trace, 0);
     INS_AddInstrumentFunction(Instruction, 0);
     PIN_AddFiniFunction(Fini, 0);
 
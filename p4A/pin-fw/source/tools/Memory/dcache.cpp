@@ -39,9 +39,13 @@ END_LEGAL */
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <map>
+#include <set>
+#include <vector>
 
 #include "cache.H"
 #include "pin_profile.H"
+#include "sim_buffer.H"
 
 
 /* ===================================================================== */
@@ -64,6 +68,14 @@ KNOB<UINT32> KnobLineSize(KNOB_MODE_WRITEONCE, "pintool",
     "b","32", "cache block size in bytes");
 KNOB<UINT32> KnobAssociativity(KNOB_MODE_WRITEONCE, "pintool",
     "a","4", "cache associativity (1 for direct mapped)");
+KNOB<BOOL>   KnobSetStats(KNOB_MODE_WRITEONCE, "pintool",
+    "set_stats", "0", "count misses per cache set and report them as a heat map");
+KNOB<BOOL>   KnobBuffered(KNOB_MODE_WRITEONCE, "pintool",
+    "buffered", "0", "record accesses in trace buffers and simulate them on a tool thread");
+KNOB<UINT32> KnobBufferPages(KNOB_MODE_WRITEONCE, "pintool",
+    "buffer_pages", "256", "number of 4 kB pages in each trace buffer");
+KNOB<UINT32> KnobBuffers(KNOB_MODE_WRITEONCE, "pintool",
+    "buffers", "3", "number of trace buffers per application thread");
 
 /* ===================================================================== */
 
@@ -108,53 +120,167 @@ typedef enum
 typedef  COUNTER_ARRAY<UINT64, COUNTER_NUM> COUNTER_HIT_MISS;
 
 
-// holds the counters with misses and hits
-// conceptually this is an array indexed by instruction address
-COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile;
+// dense instruction ids, handed out at instrumentation time which Pin
+// serializes, so analysis code never has to look an address up
+std::map<ADDRINT, UINT32> instIds;
+std::vector<ADDRINT> instAddrs;
+
+UINT32 InstId(ADDRINT iaddr)
+{
+    std::map<ADDRINT, UINT32>::const_iterator it = instIds.find(iaddr);
+    if (it != instIds.end()) return it->second;
+
+    const UINT32 instId = instAddrs.size();
+    instIds[iaddr] = instId;
+    instAddrs.push_back(iaddr);
+    return instId;
+}
+
+/*!
+ *  Hit and miss counters of one thread, indexed by instruction id. The
+ *  array starts on a cache line and spans whole lines, so no two threads
+ *  ever write the same line. It grows when an instruction instrumented
+ *  after the last growth first runs in this thread.
+ */
+class THREAD_PROFILE
+{
+  private:
+    static const UINT32 LINE_SIZE = 64;
+    static const UINT32 PER_LINE = LINE_SIZE / sizeof(COUNTER_HIT_MISS);
+
+    UINT8 * _raw;
+    COUNTER_HIT_MISS * _counters;
+    UINT32 _size;
+
+    VOID Grow(UINT32 instId)
+    {
+        UINT32 size = (_size ? 2 * _size : 1024);
+        while (size <= instId) size *= 2;
+        size = (size + PER_LINE - 1) / PER_LINE * PER_LINE;
+
+        UINT8 * raw = new UINT8[size * sizeof(COUNTER_HIT_MISS) + LINE_SIZE];
+        COUNTER_HIT_MISS * counters = reinterpret_cast<COUNTER_HIT_MISS *>(
+            (reinterpret_cast<ADDRINT>(raw) + LINE_SIZE - 1) & ~ADDRINT(LINE_SIZE - 1));
+
+        for (UINT32 i = 0; i < size; i++)
+        {
+            for (UINT32 c = 0; c < COUNTER_NUM; c++)
+            {
+                counters[i][c] = (i < _size ? _counters[i][c] : 0);
+            }
+        }
+        delete [] _raw;
+
+        _raw = raw;
+        _counters = counters;
+        _size = size;
+    }
+
+  public:
+    THREAD_PROFILE() : _raw(0), _counters(0), _size(0) {}
+    ~THREAD_PROFILE() { delete [] _raw; }
+
+    UINT32 Size() const { return _size; }
+    const COUNTER_HIT_MISS & operator[](UINT32 instId) const { return _counters[instId]; }
+
+    COUNTER_HIT_MISS & operator[](UINT32 instId)
+    {
+        if (instId >= _size) Grow(instId);
+        return _counters[instId];
+    }
+};
+
+// tool register holding the THREAD_PROFILE of the running thread
+REG profileReg;
+
+// counters of threads that have exited, indexed by instruction id
+std::vector<COUNTER_HIT_MISS> totals;
+std::set<THREAD_PROFILE *> liveProfiles;
+PIN_LOCK totalsLock;
+
+VOID MergeProfile(const THREAD_PROFILE & tp)
+{
+    if (totals.size() < tp.Size())
+    {
+        totals.resize(tp.Size(), COUNTER_HIT_MISS());
+    }
+    for (UINT32 i = 0; i < tp.Size(); i++)
+    {
+        for (UINT32 c = 0; c < COUNTER_NUM; c++)
+        {
+            totals[i][c] += tp[i][c];
+        }
+    }
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT * ctxt, INT32 flags, VOID * v)
+{
+    THREAD_PROFILE * tp = new THREAD_PROFILE;
+
+    PIN_GetLock(&totalsLock, tid + 1);
+    liveProfiles.insert(tp);
+    PIN_ReleaseLock(&totalsLock);
+
+    PIN_SetContextReg(ctxt, profileReg, reinterpret_cast<ADDRINT>(tp));
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT * ctxt, INT32 code, VOID * v)
+{
+    THREAD_PROFILE * tp =
+        reinterpret_cast<THREAD_PROFILE *>(PIN_GetContextReg(ctxt, profileReg));
+
+    PIN_GetLock(&totalsLock, tid + 1);
+    if (liveProfiles.erase(tp))
+    {
+        MergeProfile(*tp);
+        delete tp;
+    }
+    PIN_ReleaseLock(&totalsLock);
+}
 
 /* ===================================================================== */
 
-VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId)
+VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId, THREAD_PROFILE * tp)
 {
     // first level D-cache
     const BOOL dl1Hit = dl1->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     const COUNTER counter = dl1Hit ? COUNTER_HIT : COUNTER_MISS;
-    profile[instId][counter]++;
+    (*tp)[instId][counter]++;
 }
 
 /* ===================================================================== */
 
-VOID StoreMulti(ADDRINT addr, UINT32 size, UINT32 instId)
+VOID StoreMulti(ADDRINT addr, UINT32 size, UINT32 instId, THREAD_PROFILE * tp)
 {
     // first level D-cache
     const BOOL dl1Hit = dl1->Access(addr, size, CACHE_BASE::ACCESS_TYPE_STORE);
 
     const COUNTER counter = dl1Hit ? COUNTER_HIT : COUNTER_MISS;
-    profile[instId][counter]++;
+    (*tp)[instId][counter]++;
 }
 
 /* ===================================================================== */
 
-VOID LoadSingle(ADDRINT addr, UINT32 instId)
+VOID LoadSingle(ADDRINT addr, UINT32 instId, THREAD_PROFILE * tp)
 {
     // @todo we may access several cache lines for 
     // first level D-cache
     const BOOL dl1Hit = dl1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     const COUNTER counter = dl1Hit ? COUNTER_HIT : COUNTER_MISS;
-    profile[instId][counter]++;
+    (*tp)[instId][counter]++;
 }
 /* ===================================================================== */
 
-VOID StoreSingle(ADDRINT addr, UINT32 instId)
+VOID StoreSingle(ADDRINT addr, UINT32 instId, THREAD_PROFILE * tp)
 {
     // @todo we may access several cache lines for 
     // first level D-cache
     const BOOL dl1Hit = dl1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_STORE);
 
     const COUNTER counter = dl1Hit ? COUNTER_HIT : COUNTER_MISS;
-    profile[instId][counter]++;
+    (*tp)[instId][counter]++;
 }
 
 /* ===================================================================== */
@@ -187,6 +313,73 @@ VOID StoreSingleFast(ADDRINT addr)
 
 
 
+/* ===================================================================== */
+/* Buffered simulation */
+/* ===================================================================== */
+
+// record of one memory operand access in a trace buffer
+struct MEMREF
+{
+    ADDRINT addr;
+    UINT32 size;
+    UINT32 ref; // instId << 1 | store
+};
+
+// instId of accesses whose instruction is not tracked
+const UINT32 NO_INST = 0x7fffffff;
+
+SIM_BUFFER * simBuffer = NULL;
+
+// counters of all buffered accesses, owned by whichever thread holds the model
+THREAD_PROFILE simProfile;
+
+VOID ProcessBuffer(const VOID * buf, UINT64 numElements)
+{
+    const MEMREF * memref = static_cast<const MEMREF *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++, memref++)
+    {
+        const CACHE_BASE::ACCESS_TYPE accessType =
+            (memref->ref & 1 ? CACHE_BASE::ACCESS_TYPE_STORE : CACHE_BASE::ACCESS_TYPE_LOAD);
+        const BOOL dl1Hit = (memref->size <= 4
+                             ? dl1->AccessSingleLine(memref->addr, accessType)
+                             : dl1->Access(memref->addr, memref->size, accessType));
+
+        const UINT32 instId = memref->ref >> 1;
+        if (instId != NO_INST)
+        {
+            simProfile[instId][dl1Hit ? COUNTER_HIT : COUNTER_MISS]++;
+        }
+    }
+}
+
+VOID InstructionBuffered(INS ins, void * v)
+{
+    UINT32 memOperands = INS_MemoryOperandCount(ins);
+
+    for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+    {
+        const UINT32 size = INS_MemoryOperandSize(ins, memOp);
+
+        for (UINT32 store = 0; store < 2; store++)
+        {
+            const BOOL accessed = (store ? INS_MemoryOperandIsWritten(ins, memOp)
+                                         : INS_MemoryOperandIsRead(ins, memOp));
+            if (! accessed) continue;
+
+            const UINT32 instId = ((store ? KnobTrackStores : KnobTrackLoads)
+                                   ? InstId(INS_Address(ins)) : NO_INST);
+
+            INS_InsertFillBufferPredicated(
+                ins, IPOINT_BEFORE, simBuffer->Id(),
+                IARG_MEMORYOP_EA, memOp, offsetof(MEMREF, addr),
+                IARG_UINT32, size, offsetof(MEMREF, size),
+                IARG_UINT32, instId << 1 | store, offsetof(MEMREF, ref),
+                IARG_END);
+        }
+    }
+}
+
 /* ===================================================================== */
 
 VOID Instruction(INS ins, void * v)
@@ -208,7 +401,7 @@ VOID Instruction(INS ins, void * v)
             {
                 // map sparse INS addresses to dense IDs
                 const ADDRINT iaddr = INS_Address(ins);
-                const UINT32 instId = profile.Map(iaddr);
+                const UINT32 instId = InstId(iaddr);
 
                 if( single )
                 {
@@ -216,6 +409,7 @@ VOID Instruction(INS ins, void * v)
                         ins, IPOINT_BEFORE, (AFUNPTR) LoadSingle,
                         IARG_MEMORYOP_EA, memOp,
                         IARG_UINT32, instId,
+                        IARG_REG_VALUE, profileReg,
                         IARG_END);
                 }
                 else
@@ -225,6 +419,7 @@ VOID Instruction(INS ins, void * v)
                         IARG_MEMORYOP_EA, memOp,
                         IARG_UINT32, size,
                         IARG_UINT32, instId,
+                        IARG_REG_VALUE, profileReg,
                         IARG_END);
                 }
             }
@@ -254,7 +449,7 @@ VOID Instruction(INS ins, void * v)
             if( KnobTrackStores )
             {
                 const ADDRINT iaddr = INS_Address(ins);
-                const UINT32 instId = profile.Map(iaddr);
+                const UINT32 instId = InstId(iaddr);
 
                 if( single )
                 {
@@ -262,6 +457,7 @@ VOID Instruction(INS ins, void * v)
                         ins, IPOINT_BEFORE,  (AFUNPTR) StoreSingle,
                         IARG_MEMORYOP_EA, memOp,
                         IARG_UINT32, instId,
+                        IARG_REG_VALUE, profileReg,
                         IARG_END);
                 }
                 else
@@ -271,6 +467,7 @@ VOID Instruction(INS ins, void * v)
                         IARG_MEMORYOP_EA,memOp,
                         IARG_UINT32, size,
                         IARG_UINT32, instId,
+                        IARG_REG_VALUE, profileReg,
                         IARG_END);
                 }
             }
@@ -315,8 +512,39 @@ VOID Fini(int code, VOID * v)
         "#\n";
     
     out << dl1->StatsLong("# ", CACHE_BASE::CACHE_TYPE_DCACHE);
+    out << dl1->SetHeatMap("# ");
 
     if( KnobTrackLoads || KnobTrackStores ) {
+        // threads still running at exit have not been merged yet
+        for (std::set<THREAD_PROFILE *>::const_iterator it = liveProfiles.begin();
+             it != liveProfiles.end(); it++)
+        {
+            MergeProfile(**it);
+        }
+        MergeProfile(simProfile);
+
+        // holds the counters with misses and hits
+        // conceptually this is an array indexed by instruction address
+        COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile(instAddrs.size() + 1);
+
+        profile.SetKeyName("iaddr          ");
+        profile.SetCounterName("dcache:miss        dcache:hit");
+
+        COUNTER_HIT_MISS threshold;
+
+        threshold[COUNTER_HIT] = KnobThresholdHit.Value();
+        threshold[COUNTER_MISS] = KnobThresholdMiss.Value();
+
+        profile.SetThreshold( threshold );
+
+        // ids were handed out in order, so mapping the addresses in the
+        // same order reproduces them
+        for (UINT32 instId = 0; instId < instAddrs.size(); instId++)
+        {
+            profile.Map(instAddrs[instId]);
+            if (instId < totals.size()) profile[instId] = totals[instId];
+        }
+
         out <<
             "#\n"
             "# LOAD stats\n"
@@ -342,18 +570,35 @@ int main(int argc, char *argv[])
                          KnobCacheSize.Value() * KILO,
                          KnobLineSize.Value(),
                          KnobAssociativity.Value());
+    if (KnobSetStats) dl1->EnableSetStats();
     
-    profile.SetKeyName("iaddr          ");
-    profile.SetCounterName("dcache:miss        dcache:hit");
-
-    COUNTER_HIT_MISS threshold;
+    PIN_InitLock(&totalsLock);
 
-    threshold[COUNTER_HIT] = KnobThresholdHit.Value();
-    threshold[COUNTER_MISS] = KnobThresholdMiss.Value();
-    
-    profile.SetThreshold( threshold );
-    
-    INS_AddInstrumentFunction(Instruction, 0);
+    if (KnobBuffered)
+    {
+        simBuffer = new SIM_BUFFER(ProcessBuffer);
+        if (! simBuffer->Start(sizeof(MEMREF), KnobBufferPages.Value(), KnobBuffers.Value()))
+        {
+            cerr << "cannot set up buffered simulation" << endl;
+            return 1;
+        }
+        INS_AddInstrumentFunction(InstructionBuffered, 0);
+    }
+    else
+    {
+        if (KnobTrackLoads || KnobTrackStores)
+        {
+            profileReg = PIN_ClaimToolRegister();
+            if (! REG_valid(profileReg))
+            {
+                cerr << "Cannot allocate a scratch register." << endl;
+                return 1;
+            }
+            PIN_AddThreadStartFunction(ThreadStart, 0);
+            PIN_AddThreadFiniFunction(ThreadFini, 0);
+        }
+        INS_AddInstrumentFunction(Instruction, 0);
+    }
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -42,6 +42,7 @@ END_LEGAL */
 
 #include "cache.H"
 #include "pin_profile.H"
+#include "sim_buffer.H"
 
 
 /* ===================================================================== */
@@ -62,6 +63,14 @@ KNOB<UINT32> KnobLineSize(KNOB_MODE_WRITEONCE, "pintool",
     "b","32", "cache block size in bytes");
 KNOB<UINT32> KnobAssociativity(KNOB_MODE_WRITEONCE, "pintool",
     "a","4", "cache associativity (1 for direct mapped)");
+KNOB<BOOL>   KnobSetStats(KNOB_MODE_WRITEONCE, "pintool",
+    "set_stats", "0", "count misses per cache set and report them as a heat map");
+KNOB<BOOL>   KnobBuffered(KNOB_MODE_WRITEONCE, "pintool",
+    "buffered", "0", "record fetches in trace buffers and simulate them on a tool thread");
+KNOB<UINT32> KnobBufferPages(KNOB_MODE_WRITEONCE, "pintool",
+    "buffer_pages", "256", "number of 4 kB pages in each trace buffer");
+KNOB<UINT32> KnobBuffers(KNOB_MODE_WRITEONCE, "pintool",
+    "buffers", "3", "number of trace buffers per application thread");
 
 /* ===================================================================== */
 
@@ -125,8 +134,7 @@ VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId)
 
 VOID LoadSingle(ADDRINT addr, UINT32 instId)
 {
-    // @todo we may access several cache lines for 
-    // first level I-cache
+    // first level I-cache, the instruction lies within one line
     const BOOL il1Hit = il1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     const COUNTER counter = il1Hit ? COUNTER_HIT : COUNTER_MISS;
@@ -135,16 +143,77 @@ VOID LoadSingle(ADDRINT addr, UINT32 instId)
 
 /* ===================================================================== */
 
-VOID LoadMultiFast(ADDRINT addr, UINT32 size)
+// fetches every line from addr to addr+size-1 once; misses and hits are
+// counted per line
+VOID FetchBlock(ADDRINT addr, UINT32 size)
 {
-    il1->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    const ADDRINT highAddr = addr + size;
+    const ADDRINT lineSize = il1->LineSize();
+
+    for (addr &= ~(lineSize - 1); addr < highAddr; addr += lineSize)
+    {
+        il1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+    }
 }
 
 /* ===================================================================== */
+/* Buffered simulation */
+/* ===================================================================== */
+
+// record of one instruction fetch in a trace buffer
+struct FETCHREF
+{
+    ADDRINT addr;
+    UINT32 size;
+    UINT32 instId;
+};
+
+SIM_BUFFER * simBuffer = NULL;
+
+VOID ProcessBuffer(const VOID * buf, UINT64 numElements)
+{
+    const FETCHREF * fetch = static_cast<const FETCHREF *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++, fetch++)
+    {
+        if (! KnobTrackInsts)
+        {
+            FetchBlock(fetch->addr, fetch->size);
+            continue;
+        }
+
+        const BOOL il1Hit = il1->Access(fetch->addr, fetch->size, CACHE_BASE::ACCESS_TYPE_LOAD);
+        profile[fetch->instId][il1Hit ? COUNTER_HIT : COUNTER_MISS]++;
+    }
+}
+
+// one record per basic block when instructions are not tracked
+VOID TraceBuffered(TRACE trace, void * v)
+{
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        INS_InsertFillBuffer(
+            BBL_InsHead(bbl), IPOINT_BEFORE, simBuffer->Id(),
+            IARG_ADDRINT, BBL_Address(bbl), offsetof(FETCHREF, addr),
+            IARG_UINT32, BBL_Size(bbl), offsetof(FETCHREF, size),
+            IARG_UINT32, 0, offsetof(FETCHREF, instId),
+            IARG_END);
+    }
+}
 
-VOID LoadSingleFast(ADDRINT addr)
+VOID InstructionBuffered(INS ins, void * v)
 {
-    il1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);    
+    // the simulator thread may be growing the profile
+    simBuffer->LockModel(PIN_ThreadId());
+    const UINT32 instId = profile.Map(INS_Address(ins));
+    simBuffer->UnlockModel();
+
+    INS_InsertFillBufferPredicated(
+        ins, IPOINT_BEFORE, simBuffer->Id(),
+        IARG_INST_PTR, offsetof(FETCHREF, addr),
+        IARG_UINT32, INS_Size(ins), offsetof(FETCHREF, size),
+        IARG_UINT32, instId, offsetof(FETCHREF, instId),
+        IARG_END);
 }
 
 /* ===================================================================== */
@@ -156,35 +225,35 @@ VOID Instruction(INS ins, void * v)
     const UINT32 instId = profile.Map(iaddr);
 
     const UINT32 size   = INS_Size(ins);
-    const BOOL   single = (size <= 4);
-                
-    if (KnobTrackInsts) {
-        if (single) {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadSingle,
-                                     IARG_ADDRINT, iaddr,
-                                     IARG_UINT32, instId,
-                                     IARG_END);
-        }
-        else {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadMulti,
-                                     IARG_UINT32, iaddr,
-                                     IARG_UINT32, size,
-                                     IARG_UINT32, instId,
-                                     IARG_END);
-        }
+    const ADDRINT lineSize = il1->LineSize();
+    const BOOL   single = ((iaddr & (lineSize - 1)) + size <= lineSize);
+
+    if (single) {
+        INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadSingle,
+                                 IARG_ADDRINT, iaddr,
+                                 IARG_UINT32, instId,
+                                 IARG_END);
     }
     else {
-        if (single) {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadSingleFast,
-                                     IARG_UINT32, iaddr,
-                                     IARG_END);
-        }
-        else {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadMultiFast,
-                                     IARG_UINT32, iaddr,
-                                     IARG_UINT32, size,
-                                     IARG_END);
-        }
+        INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadMulti,
+                                 IARG_ADDRINT, iaddr,
+                                 IARG_UINT32, size,
+                                 IARG_UINT32, instId,
+                                 IARG_END);
+    }
+}
+
+/* ===================================================================== */
+
+// without per-instruction counters, fetches are simulated a block at a time
+VOID Trace(TRACE trace, void * v)
+{
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR) FetchBlock,
+                       IARG_ADDRINT, BBL_Address(bbl),
+                       IARG_UINT32, BBL_Size(bbl),
+                       IARG_END);
     }
 }
 
@@ -206,6 +275,7 @@ VOID Fini(int code, VOID * v)
         "#\n";
     
     out << il1->StatsLong("# ", CACHE_BASE::CACHE_TYPE_ICACHE);
+    out << il1->SetHeatMap("# ");
 
     if (KnobTrackInsts) {
         out <<
@@ -233,6 +303,7 @@ int main(int argc, char *argv[])
                          KnobCacheSize.Value() * KILO,
                          KnobLineSize.Value(),
                          KnobAssociativity.Value());
+    if (KnobSetStats) il1->EnableSetStats();
 
     profile.SetKeyName("iaddr          ");
     profile.SetCounterName("icache:miss        icache:hit");
@@ -244,7 +315,22 @@ int main(int argc, char *argv[])
     
     profile.SetThreshold( threshold );
     
-    INS_AddInstrumentFunction(Instruction, 0);
+    if (KnobBuffered)
+    {
+        simBuffer = new SIM_BUFFER(ProcessBuffer);
+        if (! simBuffer->Start(sizeof(FETCHREF), KnobBufferPages.Value(), KnobBuffers.Value()))
+        {
+            cerr << "cannot set up buffered simulation" << endl;
+            return 1;
+        }
+        if (KnobTrackInsts) INS_AddInstrumentFunction(InstructionBuffered, 0);
+        else TRACE_AddInstrumentFunction(TraceBuffered, 0);
+    }
+    else
+    {
+        if (KnobTrackInsts) INS_AddInstrumentFunction(Instruction, 0);
+        else TRACE_AddInstrumentFunction(Trace, 0);
+    }
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns